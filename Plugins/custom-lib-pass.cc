@@ -1,3 +1,4 @@
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Demangle/Demangle.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
@@ -11,8 +12,6 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
-#include <algorithm>
-#include <map>
 #include <memory>
 #include <vector>
 
@@ -26,8 +25,8 @@ struct lst {
     Instruction *f;
 };
 
-typedef vector<Function *> flst;
-typedef map<Function *, flst> flmap;
+// libc function to its safe_ counterpart, looked up once per call
+typedef DenseMap<Function *, Function *> flmap;
 typedef vector<lst> fllist;
 class CustomLibModPass : public ModulePass {
     size_t chg;
@@ -74,7 +73,7 @@ class CustomLibModPass : public ModulePass {
                           SymbolTableList<Instruction> &,
                           SymbolTableList<Instruction>::iterator &);
     bool updateInst(Function *, CallInst *, SymbolTableList<Instruction> &,
-                    SymbolTableList<Instruction>::iterator &, Function *);
+                    SymbolTableList<Instruction>::iterator &);
     void finalizeInstLst(SymbolTableList<Instruction> &);
 
   public:
@@ -114,52 +113,43 @@ bool CustomLibModPass::updateIntrinsics(
 
 bool CustomLibModPass::updateInst(Function *FCI, CallInst *CI,
                                   SymbolTableList<Instruction> &BBlst,
-                                  SymbolTableList<Instruction>::iterator &bbbeg,
-                                  Function *ToFnc) {
-    flst::const_iterator fit;
-
-    auto flm = fm.find(ToFnc);
+                                  SymbolTableList<Instruction>::iterator &bbbeg) {
+    bool upd = false;
+    auto nArgs = CI->getNumArgOperands();
 
-    if (flm == fm.end())
-        return false;
+    // the arguments first, a replaced call copies them afterwards
+    for (auto i = 0ul; i < nArgs; i++) {
+        Function *FCN = dyn_cast<Function>(CI->getArgOperand(i));
+        if (!FCN)
+            continue;
 
-    auto fl = flm->second;
+        auto fit = fm.find(FCN);
+        if (fit == fm.end())
+            continue;
 
-    FunctionType *ToFt = ToFnc->getFunctionType();
+        CI->setArgOperand(i, fit->second);
+        if (vb)
+            outs() << FCN->getName() << " argument updated of "
+                   << FCI->getName() << " to " << fit->second->getName()
+                   << '\n';
+        upd = true;
+    }
 
-    if ((fit = find(fl.begin(), fl.end(), FCI)) != fl.end()) {
+    auto fit = fm.find(FCI);
+    if (fit != fm.end()) {
+        Function *ToFnc = fit->second;
         vector<Value *> fnCallArgs;
 
-        for (auto &Arg : CI->arg_operands()) {
-            Value *Val = dyn_cast<Value>(Arg);
-            fnCallArgs.push_back(Val);
-        }
+        for (auto i = 0ul; i < nArgs; i++)
+            fnCallArgs.push_back(CI->getArgOperand(i));
 
-        CallInst *cInst = CallInst::Create(ToFt, ToFnc, fnCallArgs);
+        CallInst *cInst =
+            CallInst::Create(ToFnc->getFunctionType(), ToFnc, fnCallArgs);
         ft.push_back({bbbeg, cInst});
-        return true;
+        upd = true;
     }
 
-    auto nArgs = CI->getNumArgOperands();
-    for (auto i = 0ul; i < nArgs; i++) {
-        Function *FCN = dyn_cast<Function>(CI->getArgOperand(i));
-        if (FCN) {
-            flst::const_iterator fit;
-
-            if ((fit = find(fl.begin(), fl.end(), FCN)) != fl.end()) {
-                CI->setArgOperand(i, ToFnc);
-                if (vb)
-                    outs()
-                        << FCN->getName() << " argument updated of "
-                        << CI->getCalledFunction()->getName() << " to "
-                        << dyn_cast<Function>(CI->getArgOperand(i))->getName()
-                        << '\n';
-                return true;
-            }
-        }
-    }
-
-    return false;
+    return upd;
 }
 
 void CustomLibModPass::finalizeInstLst(SymbolTableList<Instruction> &BBlst) {
@@ -312,7 +302,7 @@ bool CustomLibModPass::runOnModule(Module &M) {
         for (const auto &fn : fns) {                                           \
             Function *Fn = M.getFunction(fn);                                  \
             if (Fn)                                                            \
-                fm[KeyFn].push_back(Fn);                                       \
+                fm[Fn] = KeyFn;                                                \
         }                                                                      \
     } while (0)
 
@@ -347,10 +337,8 @@ bool CustomLibModPass::runOnModule(Module &M) {
 
                     if (updateIntrinsics(FCI, CI, BBlst, bbbeg))
                         chg++;
-                    for (auto &Fentry : fm) {
-                        if (updateInst(FCI, CI, BBlst, bbbeg, Fentry.first))
-                            chg++;
-                    }
+                    if (updateInst(FCI, CI, BBlst, bbbeg))
+                        chg++;
                 }
             }
 
@@ -0,0 +1,261 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+#include <stdlib.h>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+struct Metric {
+    double Value;
+    bool HigherIsBetter;
+};
+
+struct Threshold {
+    string Prefix;
+    double Percent;
+};
+
+static vector<Threshold> thresholds;
+static double defaultThreshold = 10.0;
+static double minNs = 0.0;
+
+static cl::opt<string> InputFile(cl::Positional, cl::init("-"),
+                                 cl::desc("<operands report>"));
+
+static cl::opt<string> BaselineFile("baseline", cl::init("baseline.json"),
+                                    cl::desc("Baseline report file"));
+
+static cl::opt<bool> SaveBaseline("save", cl::init(false),
+                                  cl::desc("Store the report as the baseline"));
+
+static cl::opt<string>
+    DefaultThreshold("threshold", cl::init("10"),
+                     cl::desc("Slowdown in percent reported as a regression"));
+
+static cl::opt<string> Thresholds(
+    "thresholds", cl::init(""),
+    cl::desc("Per metric slowdowns, prefix=percent list "
+             "(tests/=15,overhead/memset=25)"));
+
+static cl::opt<string>
+    MinNs("min-ns", cl::init("0"),
+          cl::desc("Skip timings below this many ns in the baseline"));
+
+static cl::opt<bool> Verbose("verbose", cl::init(false),
+                             cl::desc("Display the unchanged metrics too"));
+
+// operands may print more before its report, which is the last JSON line
+static bool readReport(const string &Path, string &Report) {
+    auto Buf = MemoryBuffer::getFileOrSTDIN(Path);
+    if (!Buf) {
+        errs() << Path << ": " << Buf.getError().message() << "\n";
+        return false;
+    }
+
+    StringRef Text = (*Buf)->getBuffer().rtrim();
+    size_t Pos = Text.rfind("\n{\"");
+    Report = (Pos == StringRef::npos ? Text : Text.substr(Pos + 1)).str();
+    if (!StringRef(Report).startswith("{\"")) {
+        errs() << Path << ": no report found\n";
+        return false;
+    }
+
+    return true;
+}
+
+static void addMetric(map<string, Metric> &Metrics, const string &Key,
+                      Optional<double> V, bool HigherIsBetter) {
+    if (V)
+        Metrics[Key] = {*V, HigherIsBetter};
+}
+
+static void collectMetrics(const json::Object &Res,
+                           map<string, Metric> &Metrics) {
+    if (auto *Tests = Res.getArray("tests")) {
+        for (auto &T : *Tests) {
+            auto *O = T.getAsObject();
+            if (!O || !O->getString("name"))
+                continue;
+            string Key = "tests/" + O->getString("name")->str();
+            auto V = O->getNumber("ns_per_iter");
+            addMetric(Metrics, Key, V ? V : O->getNumber("median_ns"), false);
+        }
+    }
+
+    if (auto *Overhead = Res.getArray("overhead")) {
+        for (auto &P : *Overhead) {
+            auto *O = P.getAsObject();
+            if (!O || !O->getString("primitive") || !O->getArray("curve"))
+                continue;
+            string Prim = "overhead/" + O->getString("primitive")->str();
+            for (auto &C : *O->getArray("curve")) {
+                auto *Pt = C.getAsObject();
+                if (!Pt || !Pt->getInteger("size"))
+                    continue;
+                string Key = Prim + "/" + to_string(*Pt->getInteger("size"));
+                addMetric(Metrics, Key + "/libc",
+                          Pt->getNumber("libc_ns_per_op"), false);
+                addMetric(Metrics, Key + "/safe",
+                          Pt->getNumber("safe_ns_per_op"), false);
+                addMetric(Metrics, Key + "/ratio", Pt->getNumber("ratio"),
+                          false);
+            }
+        }
+    }
+
+    if (auto *Scaling = Res.getArray("scaling")) {
+        for (auto &S : *Scaling) {
+            auto *O = S.getAsObject();
+            if (!O || !O->getString("workload") || !O->getInteger("threads"))
+                continue;
+            string Key = "scaling/" + O->getString("workload")->str() + "/" +
+                         to_string(*O->getInteger("threads"));
+            addMetric(Metrics, Key, O->getNumber("aggregate_ops_per_sec"),
+                      true);
+        }
+    }
+}
+
+static bool loadMetrics(const string &Path, map<string, Metric> &Metrics) {
+    string Report;
+    if (!readReport(Path, Report))
+        return false;
+
+    auto Root = json::parse(Report);
+    if (!Root) {
+        errs() << Path << ": " << toString(Root.takeError()) << "\n";
+        return false;
+    }
+
+    auto *Targets = Root->getAsObject();
+    if (!Targets) {
+        errs() << Path << ": not a report\n";
+        return false;
+    }
+
+    // one object per target triple
+    for (auto &T : *Targets) {
+        if (auto *Res = T.second.getAsObject())
+            collectMetrics(*Res, Metrics);
+    }
+
+    return true;
+}
+
+static bool parseThresholds(const string &List) {
+    StringRef Rest(List);
+    while (!Rest.empty()) {
+        StringRef Item;
+        std::tie(Item, Rest) = Rest.split(',');
+        StringRef Prefix, Pct;
+        std::tie(Prefix, Pct) = Item.split('=');
+        double P;
+        if (Prefix.empty() || Pct.getAsDouble(P) || P < 0)
+            return false;
+        thresholds.push_back({Prefix.str(), P});
+    }
+
+    return true;
+}
+
+// the longest matching prefix wins
+static double thresholdFor(const string &Key) {
+    double Pct = defaultThreshold;
+    size_t Best = 0;
+    for (auto &T : thresholds) {
+        if (T.Prefix.size() > Best && StringRef(Key).startswith(T.Prefix)) {
+            Pct = T.Percent;
+            Best = T.Prefix.size();
+        }
+    }
+
+    return Pct;
+}
+
+static int saveBaseline(void) {
+    string Report;
+    if (!readReport(InputFile, Report))
+        return 2;
+
+    auto Root = json::parse(Report);
+    if (!Root) {
+        errs() << InputFile << ": " << toString(Root.takeError()) << "\n";
+        return 2;
+    }
+
+    std::error_code EC;
+    raw_fd_ostream Out(BaselineFile, EC, sys::fs::F_None);
+    if (EC) {
+        errs() << BaselineFile << ": " << EC.message() << "\n";
+        return 2;
+    }
+    Out << Report << "\n";
+    errs() << "Baseline stored in " << BaselineFile << "\n";
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "operands report comparison");
+
+    defaultThreshold = ::strtod(DefaultThreshold.c_str(), nullptr);
+    minNs = ::strtod(MinNs.c_str(), nullptr);
+    if (defaultThreshold < 0 || minNs < 0 || !parseThresholds(Thresholds)) {
+        errs() << "Invalid thresholds\n";
+        return 2;
+    }
+
+    if (SaveBaseline)
+        return saveBaseline();
+
+    map<string, Metric> Base, Cur;
+    if (!loadMetrics(BaselineFile, Base) || !loadMetrics(InputFile, Cur))
+        return 2;
+
+    size_t compared = 0, regressions = 0, missing = 0;
+    for (auto &B : Base) {
+        auto C = Cur.find(B.first);
+        if (C == Cur.end()) {
+            missing++;
+            continue;
+        }
+
+        double Old = B.second.Value, New = C->second.Value;
+        bool IsRatio = StringRef(B.first).endswith("/ratio");
+        if (Old <= 0 || New <= 0 ||
+            (!B.second.HigherIsBetter && !IsRatio && Old < minNs))
+            continue;
+
+        // slowdown in percent, positive when the current run is worse
+        double Slowdown = B.second.HigherIsBetter ? (Old / New - 1) * 100
+                                                  : (New / Old - 1) * 100;
+        double Limit = thresholdFor(B.first);
+        bool Regressed = Slowdown > Limit;
+        compared++;
+        if (Regressed)
+            regressions++;
+
+        if (!Regressed && !Verbose)
+            continue;
+        outs() << format("%-48s %14.2f %14.2f %+8.1f%%", B.first.c_str(), Old,
+                         New, Slowdown);
+        if (Regressed)
+            outs() << format("  > %.1f%%", Limit);
+        outs() << "\n";
+    }
+
+    outs() << compared << " metrics compared, " << regressions
+           << " regressions";
+    if (missing)
+        outs() << ", " << missing << " missing from the run";
+    outs() << "\n";
+
+    return regressions ? 1 : 0;
+}
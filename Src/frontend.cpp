@@ -1,5 +1,8 @@
+#include "llvm/ADT/Triple.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/IRPrintingPasses.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
@@ -12,13 +15,24 @@
 #include "llvm/CodeGen/CommandFlags.def"
 #endif
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#if LLVM_VERSION_MAJOR >= 9
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#endif
 #include "llvm/MC/SubtargetFeature.h"
+#if LLVM_VERSION_MAJOR >= 9
+#include "llvm/Passes/PassBuilder.h"
+#endif
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
 
 #if defined(__linux__) && !defined(__ANDROID__)
 #include <bsd/stdlib.h>
@@ -32,104 +46,208 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 using namespace llvm;
 using namespace std;
 
-static string targetTriple = sys::getDefaultTargetTriple();
-static string targetCpu = "generic";
-static string targetFeatures = "";
-static TargetOptions targetOptions;
-static bool hasMallocUsableSize = false;
-static bool hasClockGettime = false;
-static bool hasArc4random = false;
-static bool hasGetentropy = false;
-static bool hasGetrandom = false;
-static bool hasPledge = false;
-static bool hasUnveil = false;
-static bool hasCapsicum = false;
-static bool hasPrctl = false;
-static bool hasExplicitBzero = false;
-static bool hasExplicitMemset = false;
-static bool hasMremapLinux = false;
-static bool hasMremapBSD = false;
-static bool hasGetauxval = false;
-static bool hasElfauxinfo = false;
-static bool hasPthreadNameLinux = false;
-static bool hasPthreadNameBSD = false;
-static bool hasPthreadGetNameBSD = false;
-static bool hasMapConceal = false;
-static bool hasMapSuperpg = false;
-static bool hasTimingsafeCmp = false;
-static bool hasConsttimeMemequal = false;
-static bool reportSep = false;
-static vector<Function *> TestFunctions;
-static Module *Mod;
-static StructType *TimespecType;
-static StructType *TimevalType;
-static StructType *PthreadType;
-static StructType *PthreadAttrType;
-static StructType *PProcMapType;
-static LoadInst *StartFMbr;
-static LoadInst *StartSMbr;
-static LoadInst *EndFMbr;
-static LoadInst *EndSMbr;
-static Value *Lim;
-static Value *ABufferSize;
-static Value *StartFAccess;
-static Value *StartSAccess;
-static Value *EndFAccess;
-static Value *EndSAccess;
-static Value *SecSettings;
-static GlobalVariable *TotalUsableSize;
-static GlobalVariable *TotalAllocated;
-static GlobalVariable *RealSize;
-static GlobalVariable *PtrSize;
-static GlobalVariable *PtrDblSize;
-static GlobalVariable *LastRandomValue;
-static GlobalVariable *LastBuffer;
-static GlobalVariable *GZero;
-static GlobalVariable *SyscallGetrandomId;
-static GlobalVariable *SyscallGetrandomMod;
-static GlobalVariable *SecRetCall;
-static GlobalVariable *ClockMonotonic;
-static GlobalVariable *PrctlSetSeccomp;
-static GlobalVariable *ProtReadWrite;
-static GlobalVariable *MapSharedAnon;
-static GlobalVariable *MapPrivate;
-static GlobalVariable *MapFixed;
-static GlobalVariable *MapConceal;
-static GlobalVariable *MapSuperPg;
-static GlobalVariable *MadvNoDump;
-static GlobalVariable *PageSize;
-static GlobalVariable *PthreadRetCall;
-static GlobalVariable *PthreadSetnameRetCall;
-static GlobalVariable *SzStrlcpy;
-static GlobalVariable *SzStrlcat;
-static GlobalVariable *MemcmpRet;
-static GlobalVariable *BcmpRet;
-static GlobalVariable *AtHwcap;
-static GlobalVariable *AtHwcap2;
-static GlobalVariable *MAtHwcap;
-static GlobalVariable *MAtHwcap2;
-static GlobalVariable *AuxVec;
-static GlobalVariable *AuxVec2;
-static GlobalVariable *GThreadName;
-static GlobalVariable *OrigThreadName;
-static GlobalVariable *Errno;
-static AllocaInst *AStart;
-static AllocaInst *AEnd;
-static CallInst *CStartInst;
-static CallInst *CEndInst;
-static Function *PrintfFnc;
-static Function *StrerrorFnc;
-
-static int32_t randomStrLen;
-static std::unique_ptr<char[]> randomStr;
+struct PairTest {
+    string Prim;
+    uint64_t Size;
+    size_t Index;
+};
+
+struct ScaleTest {
+    string Workload;
+    uint64_t Threads;
+    Function *Fnc;
+    GlobalVariable *Args;
+    Value *Iterations;
+};
+
+// one generated module with its context, target settings and the IR
+// values the tests share; each object builds its module independently
+class Generator {
+  public:
+    Generator()
+        : Ctx(new LLVMContext), RootBuilder(*Ctx),
+          Mod(new Module("mpass", *Ctx)) {}
+    ~Generator() { delete Mod; }
+
+    // handed over with the module when it runs in the JIT
+    unique_ptr<LLVMContext> Ctx;
+    IRBuilder<> RootBuilder;
+    Module *Mod;
+    unique_ptr<TargetMachine> targetMachine;
+    string targetTriple = sys::getDefaultTargetTriple();
+    string targetCpu = "generic";
+    bool targetCpuSet = false;
+    string outputPrefix = "objs/operands";
+    string targetFeatures = "";
+    TargetOptions targetOptions;
+    bool hasMallocUsableSize = false;
+    bool hasClockGettime = false;
+    bool hasArc4random = false;
+    bool hasGetentropy = false;
+    bool hasGetrandom = false;
+    bool hasPledge = false;
+    bool hasUnveil = false;
+    bool hasCapsicum = false;
+    bool hasPrctl = false;
+    bool hasExplicitBzero = false;
+    bool hasExplicitMemset = false;
+    bool hasMremapLinux = false;
+    bool hasMremapBSD = false;
+    bool hasGetauxval = false;
+    bool hasElfauxinfo = false;
+    bool hasPthreadNameLinux = false;
+    bool hasPthreadNameBSD = false;
+    bool hasPthreadGetNameBSD = false;
+    bool hasMapConceal = false;
+    bool hasMapSuperpg = false;
+    bool hasTimingsafeCmp = false;
+    bool hasConsttimeMemequal = false;
+    bool hasLfence = false;
+    bool hasPerfEvent = false;
+    int32_t perfEventOpenId = 0;
+    bool reportSep = false;
+    // outs(), or the buffer a -targets worker prints once its target is done
+    raw_ostream *Out = &outs();
+    vector<Function *> TestFunctions;
+    vector<Value *> TestIterations;
+    vector<PairTest> PairTests;
+    vector<uint64_t> sweepSizes;
+    vector<ScaleTest> ScaleTests;
+    vector<uint64_t> scaleThreads;
+    StructType *ScaleArgType;
+    GlobalVariable *ScaleReady;
+    GlobalVariable *PerfFds;
+    GlobalVariable *PerfValues;
+    StructType *TimespecType;
+    StructType *TimevalType;
+    StructType *PthreadType;
+    StructType *PthreadAttrType;
+    StructType *PProcMapType;
+    LoadInst *StartFMbr;
+    LoadInst *StartSMbr;
+    LoadInst *EndFMbr;
+    LoadInst *EndSMbr;
+    Value *Lim;
+    Value *ABufferSize;
+    Value *StartFAccess;
+    Value *StartSAccess;
+    Value *EndFAccess;
+    Value *EndSAccess;
+    Value *SecSettings;
+    GlobalVariable *TotalUsableSize;
+    GlobalVariable *TotalAllocated;
+    GlobalVariable *RealSize;
+    GlobalVariable *PtrSize;
+    GlobalVariable *PtrDblSize;
+    GlobalVariable *LastRandomValue;
+    GlobalVariable *LastBuffer;
+    GlobalVariable *GZero;
+    GlobalVariable *SyscallGetrandomId;
+    GlobalVariable *SyscallGetrandomMod;
+    GlobalVariable *SecRetCall;
+    GlobalVariable *ClockMonotonic;
+    GlobalVariable *PrctlSetSeccomp;
+    GlobalVariable *ProtReadWrite;
+    GlobalVariable *MapSharedAnon;
+    GlobalVariable *MapPrivate;
+    GlobalVariable *MapFixed;
+    GlobalVariable *MapConceal;
+    GlobalVariable *MapSuperPg;
+    GlobalVariable *MadvNoDump;
+    GlobalVariable *PageSize;
+    GlobalVariable *PthreadRetCall;
+    GlobalVariable *PthreadSetnameRetCall;
+    GlobalVariable *SzStrlcpy;
+    GlobalVariable *SzStrlcat;
+    GlobalVariable *MemcmpRet;
+    GlobalVariable *BcmpRet;
+    GlobalVariable *AtHwcap;
+    GlobalVariable *AtHwcap2;
+    GlobalVariable *MAtHwcap;
+    GlobalVariable *MAtHwcap2;
+    GlobalVariable *AuxVec;
+    GlobalVariable *AuxVec2;
+    GlobalVariable *GThreadName;
+    GlobalVariable *OrigThreadName;
+    GlobalVariable *Errno;
+    AllocaInst *AStart;
+    AllocaInst *AEnd;
+    CallInst *CStartInst;
+    CallInst *CEndInst;
+    Function *PrintfFnc;
+    Function *StrerrorFnc;
+    int32_t randomStrLen;
+    int64_t warmupRuns;
+    int64_t measuredRuns;
+    std::unique_ptr<char[]> randomStr;
+    size_t progressIndex = 0;
+    size_t totalTests = 7;
+
+    void printReport(IRBuilder<> Builder, Function *Fnc);
+    Function *addBasicFunction(IRBuilder<> Builder, string Name);
+    void addBasicBlock(IRBuilder<> Builder, string Name,
+                       Instruction::BinaryOps op, Function *Fnc);
+    Function *addMTFunction(IRBuilder<> Builder, string Name);
+    void addMTBlock(IRBuilder<> Builder, string Name);
+    Function *addTestFunction(IRBuilder<> Builder, const char *FName);
+    void addTestBlock(IRBuilder<> Builder, const char *FName,
+                      Function *TestFnc);
+    Function *addMemoryTestFunction(IRBuilder<> Builder);
+    void addMemoryTestBlock(IRBuilder<> Builder);
+    Function *addMemoryFunction(IRBuilder<> Builder);
+    void addMemoryBlock(IRBuilder<> Builder);
+    Function *addRandomnessFunction(IRBuilder<> Builder);
+    void addRandomnessBlock(IRBuilder<> Builder);
+    Function *addMTTest(IRBuilder<> Builder, string FName);
+    void addMTTestBlock(IRBuilder<> Builder, const char *FName,
+                        Function *TestFnc);
+    void addEscape(IRBuilder<> Builder, Value *V);
+    Function *addPairTest(IRBuilder<> Builder, string Prim, uint64_t Sz,
+                          bool Safe);
+    Function *addClockFunction(IRBuilder<> Builder);
+    Value *addClockRead(IRBuilder<> Builder, AllocaInst *Slot);
+    Value *addCycleRead(IRBuilder<> Builder);
+    Function *addPerfOpenFunction(IRBuilder<> Builder);
+    void addPerfIoctl(IRBuilder<> Builder, uint64_t Request);
+    void addPerfRead(IRBuilder<> Builder);
+    Function *addBenchCmpFunction(IRBuilder<> Builder);
+    Function *addBenchRunFunction(IRBuilder<> Builder);
+    Function *addBenchStatsFunction(IRBuilder<> Builder);
+    Function *addScaleWorkerFunction(IRBuilder<> Builder);
+    Function *addScaleTest(IRBuilder<> Builder, string Workload,
+                           Function *TestFnc, Value *Iterations,
+                           uint64_t Workers);
+    Function *addMain(IRBuilder<> Builder);
+    void addMainBlock(IRBuilder<> Builder, Function *MainFnc);
+    void compileObjectFile(TargetMachine *targetMachine, string FileName);
+    bool optimize(void);
+    int tasks(void *oBuilder);
+    bool setup(void);
+    void emit(void);
+    int jit(void);
+    string cacheKey(int argc, char **argv);
+    bool fromCache(const string &Key);
+    void toCache(const string &Key);
+};
 
 static cl::opt<string>
     NumIterations("iterations", cl::init("1024"),
                   cl::desc("Number of iterations for the running tests"));
 
+static cl::opt<string> WarmupRuns("warmup", cl::init("1"),
+                                  cl::desc("Unmeasured runs of each test"));
+
+static cl::opt<string>
+    MeasuredRuns("repetitions", cl::init("5"),
+                 cl::desc("Measured runs of each test for the statistics"));
+
 static cl::opt<string> RandomBufferSize("random-buffer-size", cl::init("32"),
                                         cl::desc("Size of the random buffer"));
 
@@ -148,6 +266,11 @@ static cl::opt<string> TargetTriple("mtriple",
 static cl::opt<string> SizeToAllocate("sizetoallocate", cl::init("64"),
                                       cl::desc("Size to allocate"));
 
+static cl::opt<string>
+    Sizes("sizes", cl::init(""),
+          cl::desc("Sizes for the libc/safe_* benchmarks, a list (8,64,4K) "
+                   "or a range (8:1M:x2, 4K:64K:+4K)"));
+
 static cl::opt<string> PledgePermissions("pledge-perms",
                                          cl::init("stdio rpath wpath"),
                                          cl::desc("pledge call permissions"));
@@ -161,13 +284,146 @@ static cl::opt<string> OptLevel("opt-level", cl::init("2"),
 static cl::opt<string> CodeLvl("code-level", cl::init("2"),
                                cl::desc("Code size level"));
 
+static cl::opt<string>
+    IrLevel("ir-level", cl::init(""),
+            cl::desc("IR pipeline run before codegen, 0 to 3, s or z, "
+                     "-opt-level by default"));
+
+static cl::opt<string>
+    Passes("passes", cl::init(""),
+           cl::desc("IR pipeline replacing the default one "
+                    "(function(sroa,instcombine),always-inline)"));
+
+static cl::opt<string>
+    Lto("lto", cl::init(""),
+        cl::desc("Write bitcode to objs/operands.bc for a full or thin LTO "
+                 "link with libs instead of the object file"));
+
 static cl::opt<bool> ForkMod("fork-mod", cl::init(false),
                              cl::desc("Launch in fork mode"));
 
-void printReport(IRBuilder<> Builder, Function *Fnc) {
+static cl::opt<bool>
+    CycleCounter("cycle-counter", cl::init(false),
+                 cl::desc("Also time the tests with the cycle counter"));
+
+static cl::opt<bool> PerfCounters(
+    "perf-counters", cl::init(false),
+    cl::desc("Count cycles, instructions, cache and branch misses of the "
+             "tests with perf_event_open (Linux)"));
+
+// libLLVM registers "threads" already (ThinLTO)
+static cl::opt<string>
+    Threads("scale-threads", cl::init("1,2,4"),
+            cl::desc("Worker counts of the scaling tests, a list (1,8,64) "
+                     "or a range (1:64:x2)"));
+
+static cl::opt<string> Targets(
+    "targets", cl::init(""),
+    cl::desc("Targets built in parallel, a list of triple[:cpu] "
+             "(x86_64-unknown-freebsd13:znver2,aarch64-linux-gnu), "
+             "each into objs/operands-<triple>[-<cpu>].o"));
+
+static cl::opt<bool>
+    Jit("jit", cl::init(false),
+        cl::desc("Run the tests in process instead of writing objs/operands.o"));
+
+static cl::opt<string>
+    JitLib("jit-lib", cl::init("objs/liblibs.so"),
+           cl::desc("Library providing the safe_* functions to -jit"));
+
+static cl::opt<bool>
+    NoCache("no-cache", cl::init(false),
+            cl::desc("Always generate, ignoring and not filling objs/cache"));
+
+static cl::opt<string>
+    Jobs("jobs", cl::init("0"),
+         cl::desc("Targets built at once, all online cpus by default"));
+
+static uint64_t parseSize(const char *Str, char **End) {
+    uint64_t Sz = ::strtoull(Str, End, 10);
+
+    switch (**End) {
+    case 'k':
+    case 'K':
+        Sz <<= 10;
+        ++*End;
+        break;
+    case 'm':
+    case 'M':
+        Sz <<= 20;
+        ++*End;
+        break;
+    case 'g':
+    case 'G':
+        Sz <<= 30;
+        ++*End;
+        break;
+    }
+
+    return Sz;
+}
+
+bool parseSizes(const string &Spec, vector<uint64_t> &Out) {
+    const char *Str = Spec.c_str();
+    char *End;
+
+    if (::strchr(Str, ':')) {
+        uint64_t Start = parseSize(Str, &End);
+        if (*End != ':')
+            return false;
+        uint64_t Stop = parseSize(End + 1, &End);
+        bool Geometric = true;
+        uint64_t Step = 2;
+
+        if (*End == ':') {
+            Geometric = (End[1] == 'x');
+            if (!Geometric && End[1] != '+')
+                return false;
+            Step = parseSize(End + 2, &End);
+        }
+
+        if (*End || Start < 1 || Stop < Start || Step < 1 ||
+            (Geometric && Step < 2))
+            return false;
+
+        for (uint64_t Sz = Start; Sz <= Stop && Out.size() < 64;
+             Sz = Geometric ? Sz * Step : Sz + Step)
+            Out.push_back(Sz);
+    } else {
+        while (*Str) {
+            Out.push_back(parseSize(Str, &End));
+            if (End == Str || (*End && *End != ','))
+                return false;
+            Str = *End ? End + 1 : End;
+        }
+    }
+
+    for (auto Sz : Out) {
+        if (Sz < 1 || Sz > INT_MAX)
+            return false;
+    }
+
+    return !Out.empty();
+}
+
+bool parseTargets(const string &Spec, vector<pair<string, string>> &Out) {
+    StringRef Rest(Spec);
+
+    while (!Rest.empty()) {
+        StringRef Item, Cpu;
+        std::tie(Item, Rest) = Rest.split(',');
+        std::tie(Item, Cpu) = Item.split(':');
+        if (Item.empty())
+            return false;
+        Out.push_back({Item.str(), Cpu.str()});
+    }
+
+    return !Out.empty();
+}
+
+void Generator::printReport(IRBuilder<> Builder, Function *Fnc) {
     char format[128];
 
-    static size_t progressIndex = 0, totalTests = 7;
     progressIndex++;
 
     ::snprintf(format, sizeof(format), "[%s %zu / %zu] in progress",
@@ -186,7 +442,7 @@ void printReport(IRBuilder<> Builder, Function *Fnc) {
     Builder.CreateCall(PrintfFnc, PrintfCallArgs);
 }
 
-Function *addBasicFunction(IRBuilder<> Builder, string Name) {
+Function *Generator::addBasicFunction(IRBuilder<> Builder, string Name) {
     vector<string> FuncArgs(1);
     FuncArgs[0] = "Num";
     size_t Idx = 0;
@@ -205,9 +461,9 @@ Function *addBasicFunction(IRBuilder<> Builder, string Name) {
     return Fnc;
 }
 
-void addBasicBlock(IRBuilder<> Builder, string Name, Instruction::BinaryOps op,
-                   Function *Fnc) {
-    static Value *One = Builder.getInt64(1);
+void Generator::addBasicBlock(IRBuilder<> Builder, string Name,
+                              Instruction::BinaryOps op, Function *Fnc) {
+    Value *One = Builder.getInt64(1);
     Value *Num = cast<Value>(Fnc->arg_begin());
     Value *Res;
     BasicBlock *Bb = BasicBlock::Create(Builder.getContext(), Name, Fnc);
@@ -217,7 +473,7 @@ void addBasicBlock(IRBuilder<> Builder, string Name, Instruction::BinaryOps op,
     Bbuilder.CreateRet(Res);
 }
 
-Function *addMTFunction(IRBuilder<> Builder, string Name) {
+Function *Generator::addMTFunction(IRBuilder<> Builder, string Name) {
     vector<Type *> MTArgs(1);
     MTArgs[0] = Builder.getInt8PtrTy();
     FunctionType *MTFt =
@@ -228,7 +484,7 @@ Function *addMTFunction(IRBuilder<> Builder, string Name) {
     return MTFn;
 }
 
-void addMTBlock(IRBuilder<> Builder, string Name) {
+void Generator::addMTBlock(IRBuilder<> Builder, string Name) {
     Function *MTFn = Mod->getFunction(Name);
     Function *RandomnessFnc = Mod->getFunction("test_randomness");
     Function *MemFnc = Mod->getFunction("test_memory");
@@ -246,7 +502,7 @@ void addMTBlock(IRBuilder<> Builder, string Name) {
                        Constant::getNullValue(Builder.getInt8PtrTy()), Entry);
 }
 
-Function *addTestFunction(IRBuilder<> Builder, const char *FName) {
+Function *Generator::addTestFunction(IRBuilder<> Builder, const char *FName) {
     FunctionType *Ft = FunctionType::get(Builder.getVoidTy(), false);
     Function *TestFnc =
         Function::Create(Ft, Function::InternalLinkage, FName, Mod);
@@ -254,7 +510,8 @@ Function *addTestFunction(IRBuilder<> Builder, const char *FName) {
     return TestFnc;
 }
 
-void addTestBlock(IRBuilder<> Builder, const char *FName, Function *TestFnc) {
+void Generator::addTestBlock(IRBuilder<> Builder, const char *FName,
+                             Function *TestFnc) {
     Function *FFnc = Mod->getFunction(FName);
     BasicBlock *Entry =
         BasicBlock::Create(Builder.getContext(), "entry", TestFnc);
@@ -278,7 +535,7 @@ void addTestBlock(IRBuilder<> Builder, const char *FName, Function *TestFnc) {
 
     vector<Value *> Args(1);
     Args[0] = Nxt;
-    LoopBuilder.CreateCall(FFnc, Args, FName);
+    addEscape(LoopBuilder, LoopBuilder.CreateCall(FFnc, Args, FName));
     Value *EndLoop = LoopBuilder.CreateICmpULT(I, Lim, "EndLoop");
     EndLoop = LoopBuilder.CreateICmpNE(EndLoop, Builder.getInt1(0), "LoopCond");
     EntryBuilder.CreateBr(Loop);
@@ -290,11 +547,12 @@ void addTestBlock(IRBuilder<> Builder, const char *FName, Function *TestFnc) {
     I->addIncoming(Nxt, LoopHeader);
 
     TestFunctions.push_back(TestFnc);
+    TestIterations.push_back(Lim);
 
     ReturnInst::Create(Builder.getContext(), nullptr, End);
 }
 
-Function *addMemoryTestFunction(IRBuilder<> Builder) {
+Function *Generator::addMemoryTestFunction(IRBuilder<> Builder) {
     FunctionType *Ft = FunctionType::get(Builder.getVoidTy(), false);
     Function *TestFnc = Function::Create(Ft, Function::InternalLinkage,
                                          "func_calls_memory", Mod);
@@ -302,7 +560,7 @@ Function *addMemoryTestFunction(IRBuilder<> Builder) {
     return TestFnc;
 }
 
-void addMemoryTestBlock(IRBuilder<> Builder) {
+void Generator::addMemoryTestBlock(IRBuilder<> Builder) {
     Function *TestFnc = Mod->getFunction("func_calls_memory");
     BasicBlock *Entry =
         BasicBlock::Create(Builder.getContext(), "entry", TestFnc);
@@ -687,9 +945,8 @@ void addMemoryTestBlock(IRBuilder<> Builder) {
 
     EntryBuilder.CreateStore(VPageSize, PageSize);
 
-    AllocaInst *DPPtr = EntryBuilder.CreateAlloca(
-        Builder.getInt8PtrTy(), Constant::getNullValue(Builder.getInt8Ty()),
-        "Dpptr");
+    AllocaInst *DPPtr =
+        EntryBuilder.CreateAlloca(Builder.getInt8PtrTy(), nullptr, "Dpptr");
 
     vector<Value *> PosixMemalignCallArgs(3);
     PosixMemalignCallArgs[0] = DPPtr;
@@ -698,9 +955,8 @@ void addMemoryTestBlock(IRBuilder<> Builder) {
 
     EntryBuilder.CreateCall(PosixMemalignFnc, PosixMemalignCallArgs);
 
-    AllocaInst *AGPtr = EntryBuilder.CreateAlloca(
-        Builder.getInt8PtrTy(), Constant::getNullValue(Builder.getInt8Ty()),
-        "Agptr");
+    AllocaInst *AGPtr =
+        EntryBuilder.CreateAlloca(Builder.getInt8PtrTy(), nullptr, "Agptr");
 
     vector<Value *> SafeAllocCallArgs(3);
     SafeAllocCallArgs[0] = AGPtr;
@@ -794,7 +1050,7 @@ void addMemoryTestBlock(IRBuilder<> Builder) {
     ReturnInst::Create(Builder.getContext(), nullptr, Entry);
 }
 
-Function *addMemoryFunction(IRBuilder<> Builder) {
+Function *Generator::addMemoryFunction(IRBuilder<> Builder) {
     FunctionType *Ft = FunctionType::get(Builder.getVoidTy(), false);
     Function *MemFnc =
         Function::Create(Ft, Function::InternalLinkage, "test_memory", Mod);
@@ -802,7 +1058,7 @@ Function *addMemoryFunction(IRBuilder<> Builder) {
     return MemFnc;
 }
 
-void addMemoryBlock(IRBuilder<> Builder) {
+void Generator::addMemoryBlock(IRBuilder<> Builder) {
     Function *TestFnc = Mod->getFunction("test_memory");
     Function *MemFnc = Mod->getFunction("func_calls_memory");
     BasicBlock *Entry =
@@ -840,11 +1096,12 @@ void addMemoryBlock(IRBuilder<> Builder) {
     I->addIncoming(Nxt, LoopHeader);
 
     TestFunctions.push_back(TestFnc);
+    TestIterations.push_back(Lim);
 
     ReturnInst::Create(Builder.getContext(), nullptr, End);
 }
 
-Function *addRandomnessFunction(IRBuilder<> Builder) {
+Function *Generator::addRandomnessFunction(IRBuilder<> Builder) {
     vector<Type *> RandomnessArgs(1);
     RandomnessArgs[0] = Builder.getInt64Ty();
     FunctionType *RandomFt =
@@ -855,7 +1112,7 @@ Function *addRandomnessFunction(IRBuilder<> Builder) {
     return RandomFnc;
 }
 
-void addRandomnessBlock(IRBuilder<> Builder) {
+void Generator::addRandomnessBlock(IRBuilder<> Builder) {
     Function *RandomFnc = Mod->getFunction("randomness");
     Function *MemsetFnc;
 
@@ -879,7 +1136,7 @@ void addRandomnessBlock(IRBuilder<> Builder) {
         BasicBlock::Create(Builder.getContext(), "entry", RandomFnc);
     Builder.SetInsertPoint(Entry);
     IRBuilder<> EntryBuilder(Entry);
-    static Value *One = Builder.getInt64(1);
+    Value *One = Builder.getInt64(1);
     Value *RandomRng = nullptr;
 
     Value *Zero = EntryBuilder.getInt8(0);
@@ -1014,13 +1271,16 @@ void addRandomnessBlock(IRBuilder<> Builder) {
     SafeRandomCallArgs[1] = ABufferLim;
     EntryBuilder.CreateCall(SafeRandomFnc, SafeRandomCallArgs);
 
-    EntryBuilder.CreateStore(ABuffer, LastBuffer);
+    // the buffer dies with this frame, keep its head for the report
+    Value *ABufferHead = EntryBuilder.CreateBitCast(
+        ABuffer, PointerType::getUnqual(Builder.getInt64Ty()));
+    EntryBuilder.CreateStore(EntryBuilder.CreateLoad(ABufferHead), LastBuffer);
     EntryBuilder.CreateStore(RandomRng, LastRandomValue);
 
     ReturnInst::Create(Builder.getContext(), Builder.getInt64(0), Entry);
 }
 
-Function *addMTTest(IRBuilder<> Builder, string FName) {
+Function *Generator::addMTTest(IRBuilder<> Builder, string FName) {
     FunctionType *Ft = FunctionType::get(Builder.getVoidTy(), false);
     Function *TestFnc =
         Function::Create(Ft, Function::InternalLinkage, FName, Mod);
@@ -1028,7 +1288,8 @@ Function *addMTTest(IRBuilder<> Builder, string FName) {
     return TestFnc;
 }
 
-void addMTTestBlock(IRBuilder<> Builder, const char *FName, Function *TestFnc) {
+void Generator::addMTTestBlock(IRBuilder<> Builder, const char *FName,
+                               Function *TestFnc) {
     Function *FFnc = Mod->getFunction(FName);
     BasicBlock *Entry =
         BasicBlock::Create(Builder.getContext(), "entry", TestFnc);
@@ -1174,11 +1435,712 @@ void addMTTestBlock(IRBuilder<> Builder, const char *FName, Function *TestFnc) {
     EntryBuilder.CreateCall(PthreadJoinFnc, PthreadJoinCallArgs);
 
     TestFunctions.push_back(TestFnc);
+    TestIterations.push_back(Builder.getInt64(1));
 
     ReturnInst::Create(Builder.getContext(), nullptr, Entry);
 }
 
-Function *addMain(IRBuilder<> Builder) {
+// keeps the optimizer from dropping a benchmarked call whose result is unused
+void Generator::addEscape(IRBuilder<> Builder, Value *V) {
+    vector<Type *> EscapeArgs(1);
+    EscapeArgs[0] = V->getType();
+    FunctionType *EscapeFt =
+        FunctionType::get(Builder.getVoidTy(), EscapeArgs, false);
+    InlineAsm *Escape = InlineAsm::get(EscapeFt, "", "r,~{memory}", true);
+    vector<Value *> EscapeCallArgs(1);
+    EscapeCallArgs[0] = V;
+    Builder.CreateCall(EscapeFt, Escape, EscapeCallArgs);
+}
+
+// same arguments loop over the libc primitive or its safe_* counterpart
+Function *Generator::addPairTest(IRBuilder<> Builder, string Prim, uint64_t Sz,
+                                 bool Safe) {
+    FunctionType *Ft = FunctionType::get(Builder.getVoidTy(), false);
+    Function *TestFnc = Function::Create(
+        Ft, Function::InternalLinkage,
+        "pair_" + Prim + (Safe ? "_safe_" : "_libc_") + to_string(Sz), Mod);
+    TestFnc->addFnAttr("no-builtins");
+
+    string LibcName = Prim;
+    if (Prim == "bzero")
+        LibcName = "explicit_bzero";
+    else if (Prim == "bcmp" && hasTimingsafeCmp)
+        LibcName = "timingsafe_bcmp";
+    else if (Prim == "bcmp" && hasConsttimeMemequal)
+        LibcName = "consttime_memequal";
+    Function *PrimFnc = Mod->getFunction(Safe ? "safe_" + Prim : LibcName);
+    Function *FreeFnc = Mod->getFunction(Safe ? "safe_free" : "free");
+    Function *MallocFnc = Mod->getFunction("malloc");
+    Function *MemsetFnc = Mod->getFunction("memset");
+
+    Value *Size = Builder.getInt64(Sz);
+    uint64_t NeedleLen = Sz < 16 ? Sz : 16;
+    // large sizes get fewer rounds, about as many bytes as 4K would touch
+    int64_t Rounds = cast<ConstantInt>(Lim)->getSExtValue();
+    if (Sz > 4096)
+        Rounds = max<int64_t>(16, Rounds / static_cast<int64_t>(Sz / 4096));
+    Value *PairLim = Builder.getInt64(Rounds);
+
+    BasicBlock *Entry =
+        BasicBlock::Create(Builder.getContext(), "entry", TestFnc);
+    BasicBlock *Loop =
+        BasicBlock::Create(Builder.getContext(), "loop", TestFnc);
+    BasicBlock *End = BasicBlock::Create(Builder.getContext(), "end", TestFnc);
+    IRBuilder<> EntryBuilder(Entry);
+
+    // a...a haystack with an absent a...ab needle, equal buffers for bcmp
+    vector<Value *> MallocCallArgs(1);
+    MallocCallArgs[0] = Size;
+    Value *A = EntryBuilder.CreateCall(MallocFnc, MallocCallArgs, "A");
+    Value *B = EntryBuilder.CreateCall(MallocFnc, MallocCallArgs, "B");
+    vector<Value *> MemsetCallArgs(3);
+    MemsetCallArgs[0] = A;
+    MemsetCallArgs[1] = EntryBuilder.getInt8('a');
+    MemsetCallArgs[2] = Size;
+    EntryBuilder.CreateCall(MemsetFnc, MemsetCallArgs);
+    MemsetCallArgs[0] = B;
+    EntryBuilder.CreateCall(MemsetFnc, MemsetCallArgs);
+    if (Prim == "memmem") {
+        Value *NeedleEnd = EntryBuilder.CreateInBoundsGEP(
+            EntryBuilder.getInt8Ty(), B, EntryBuilder.getInt64(NeedleLen - 1));
+        EntryBuilder.CreateStore(EntryBuilder.getInt8('b'), NeedleEnd);
+    }
+    EntryBuilder.CreateBr(Loop);
+
+    IRBuilder<> LoopBuilder(Loop);
+    PHINode *I = LoopBuilder.CreatePHI(Builder.getInt64Ty(), 2, "I");
+    I->addIncoming(Builder.getInt64(1), Entry);
+    vector<Value *> CallArgs;
+
+    if (Prim == "memset") {
+        CallArgs = {A, Builder.getInt8(0), Size};
+        LoopBuilder.CreateCall(PrimFnc, CallArgs);
+        addEscape(LoopBuilder, A);
+    } else if (Prim == "bzero") {
+        CallArgs = {A, Size};
+        LoopBuilder.CreateCall(PrimFnc, CallArgs);
+        addEscape(LoopBuilder, A);
+    } else if (Prim == "bcmp") {
+        CallArgs = {A, B, Size};
+        addEscape(LoopBuilder, LoopBuilder.CreateCall(PrimFnc, CallArgs));
+    } else if (Prim == "memmem") {
+        CallArgs = {A, Size, B, Builder.getInt64(NeedleLen)};
+        addEscape(LoopBuilder, LoopBuilder.CreateCall(PrimFnc, CallArgs));
+    } else {
+        Value *P;
+        if (Prim == "realloc") {
+            CallArgs = {Builder.getInt64(Sz / 2 + 1)};
+            P = LoopBuilder.CreateCall(
+                Mod->getFunction(Safe ? "safe_malloc" : "malloc"), CallArgs);
+            CallArgs = {P, Size};
+        } else if (Prim == "calloc") {
+            CallArgs = {Builder.getInt64(1), Size};
+        } else {
+            CallArgs = {Size};
+        }
+        P = LoopBuilder.CreateCall(PrimFnc, CallArgs);
+        addEscape(LoopBuilder, P);
+        vector<Value *> FreeCallArgs(1);
+        FreeCallArgs[0] = P;
+        LoopBuilder.CreateCall(FreeFnc, FreeCallArgs);
+    }
+
+    Value *Nxt = LoopBuilder.CreateAdd(I, Builder.getInt64(1), "Nxt");
+    I->addIncoming(Nxt, Loop);
+    LoopBuilder.CreateCondBr(LoopBuilder.CreateICmpULT(I, PairLim, "EndLoop"),
+                             Loop, End);
+
+    IRBuilder<> EndBuilder(End);
+    vector<Value *> FreeCallArgs(1);
+    FreeCallArgs[0] = A;
+    EndBuilder.CreateCall(Mod->getFunction("free"), FreeCallArgs);
+    FreeCallArgs[0] = B;
+    EndBuilder.CreateCall(Mod->getFunction("free"), FreeCallArgs);
+    EndBuilder.CreateRetVoid();
+
+    if (!Safe)
+        PairTests.push_back({Prim, Sz, TestFunctions.size()});
+    TestFunctions.push_back(TestFnc);
+    TestIterations.push_back(PairLim);
+
+    return TestFnc;
+}
+
+// clock_gettime or gettimeofday, declared by whichever test reads it first
+Function *Generator::addClockFunction(IRBuilder<> Builder) {
+    const char *Name = hasClockGettime ? "clock_gettime" : "gettimeofday";
+    Function *ClockFnc = Mod->getFunction(Name);
+    if (ClockFnc)
+        return ClockFnc;
+
+    vector<Type *> ClockTypes(2);
+    if (hasClockGettime) {
+        ClockTypes[0] = Type::getInt32Ty(Builder.getContext());
+        ClockTypes[1] = PointerType::getUnqual(TimespecType);
+    } else {
+        ClockTypes[0] = PointerType::getUnqual(TimevalType);
+        ClockTypes[1] = Builder.getInt8PtrTy();
+    }
+
+    FunctionType *ClockFt = FunctionType::get(
+        Type::getInt32Ty(Builder.getContext()), ClockTypes, false);
+    ClockFnc = Function::Create(ClockFt, Function::ExternalLinkage, Name, Mod);
+    ClockFnc->setCallingConv(CallingConv::C);
+
+    return ClockFnc;
+}
+
+Value *Generator::addClockRead(IRBuilder<> Builder, AllocaInst *Slot) {
+    StructType *SlotType = hasClockGettime ? TimespecType : TimevalType;
+    vector<Value *> TimeArgs(2);
+    CallInst *ClockInst;
+
+    if (hasClockGettime) {
+        TimeArgs[0] = Builder.CreateLoad(ClockMonotonic);
+        TimeArgs[1] = Slot;
+    } else {
+        TimeArgs[0] = Slot;
+        TimeArgs[1] = Constant::getNullValue(Builder.getInt8PtrTy());
+    }
+    ClockInst = Builder.CreateCall(addClockFunction(Builder), TimeArgs);
+
+    ClockInst->setMetadata(Mod->getMDKindID("nosanitize"),
+                           MDNode::get(Builder.getContext(), None));
+
+    vector<Value *> SlotIndexes(2);
+    SlotIndexes[0] = Builder.getInt32(0);
+    SlotIndexes[1] = Builder.getInt32(0);
+    Value *SecAccess =
+        Builder.CreateInBoundsGEP(SlotType, Slot, SlotIndexes, "Secaccess");
+    LoadInst *Sec = Builder.CreateLoad(SecAccess, "Sec");
+    Sec->setMetadata(Mod->getMDKindID("nosanitize"),
+                     MDNode::get(Builder.getContext(), None));
+    SlotIndexes[1] = Builder.getInt32(1);
+    Value *FracAccess =
+        Builder.CreateInBoundsGEP(SlotType, Slot, SlotIndexes, "Fracaccess");
+    LoadInst *Frac = Builder.CreateLoad(FracAccess, "Frac");
+    Frac->setMetadata(Mod->getMDKindID("nosanitize"),
+                      MDNode::get(Builder.getContext(), None));
+
+    // tv_usec is 32 bits and in microseconds
+    Value *FracNs = Frac;
+    if (!hasClockGettime)
+        FracNs = Builder.CreateMul(
+            Builder.CreateSExt(Frac, Builder.getInt64Ty()),
+            Builder.getInt64(1000));
+
+    return Builder.CreateAdd(
+        Builder.CreateMul(Sec, Builder.getInt64(1000000000)), FracNs, "Ns");
+}
+
+// readcyclecounter is a plain rdtsc on x86, lfence keeps it from being
+// reordered with the timed code
+Value *Generator::addCycleRead(IRBuilder<> Builder) {
+    FunctionType *FenceFt = FunctionType::get(Builder.getVoidTy(), false);
+    InlineAsm *Fence = InlineAsm::get(FenceFt, "lfence", "~{memory}", true);
+    ArrayRef<Value *> Args;
+
+    if (hasLfence)
+        Builder.CreateCall(FenceFt, Fence, Args);
+    Value *Cycles = Builder.CreateCall(
+        Intrinsic::getDeclaration(Mod, Intrinsic::readcyclecounter), Args,
+        "Cycles");
+    if (hasLfence)
+        Builder.CreateCall(FenceFt, Fence, Args);
+
+    return Cycles;
+}
+
+// opens the cycles, instructions, cache-misses and branch-misses group of
+// the calling thread, inherited by the threads it creates so the scaling
+// and mthread workers are counted too, a counter the kernel refuses keeps a
+// -1 descriptor
+Function *Generator::addPerfOpenFunction(IRBuilder<> Builder) {
+    FunctionType *Ft = FunctionType::get(Builder.getVoidTy(), false);
+    Function *PerfOpenFnc =
+        Function::Create(Ft, Function::InternalLinkage, "perf_open", Mod);
+    Function *SyscallFnc = Mod->getFunction("syscall");
+    if (!SyscallFnc) {
+        vector<Type *> SyscallArgs(1);
+        SyscallArgs[0] = Builder.getInt32Ty();
+        FunctionType *SyscallFt =
+            FunctionType::get(Builder.getInt64Ty(), SyscallArgs, true);
+        SyscallFnc = Function::Create(SyscallFt, Function::ExternalLinkage,
+                                      "syscall", Mod);
+        SyscallFnc->setCallingConv(CallingConv::C);
+    }
+
+    BasicBlock *Entry =
+        BasicBlock::Create(Builder.getContext(), "entry", PerfOpenFnc);
+    IRBuilder<> EntryBuilder(Entry);
+    // PERF_COUNT_HW_CPU_CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES
+    const uint64_t Events[] = {0, 1, 3, 5};
+    Value *Leader = EntryBuilder.getInt64(-1);
+
+    for (size_t i = 0; i < 4; i++) {
+        // PERF_ATTR_SIZE_VER0 perf_event_attr, PERF_TYPE_HARDWARE, the
+        // leader starts disabled, inherit, kernel and hypervisor excluded;
+        // no PERF_FORMAT_GROUP, the kernel refuses it with inherit and each
+        // counter is read on its own descriptor
+        uint64_t Attr[8] = {static_cast<uint64_t>(64) << 32, Events[i]};
+        Attr[5] = (i == 0 ? 1 : 0) | (1 << 1) | (1 << 5) | (1 << 6);
+        Constant *AttrInit = ConstantDataArray::get(Builder.getContext(),
+                                                    ArrayRef<uint64_t>(Attr));
+        GlobalVariable *AttrVar = new GlobalVariable(
+            *Mod, AttrInit->getType(), true, GlobalVariable::PrivateLinkage,
+            AttrInit, "Perfattr");
+
+        vector<Value *> SyscallCallArgs(6);
+        SyscallCallArgs[0] = EntryBuilder.getInt32(perfEventOpenId);
+        SyscallCallArgs[1] =
+            EntryBuilder.CreateBitCast(AttrVar, Builder.getInt8PtrTy());
+        SyscallCallArgs[2] = EntryBuilder.getInt64(0);
+        SyscallCallArgs[3] = EntryBuilder.getInt64(-1);
+        SyscallCallArgs[4] = Leader;
+        SyscallCallArgs[5] = EntryBuilder.getInt64(0);
+        Value *Fd = EntryBuilder.CreateCall(SyscallFnc, SyscallCallArgs, "Fd");
+        if (i == 0)
+            Leader = Fd;
+
+        vector<Value *> FdIndexes(2);
+        FdIndexes[0] = EntryBuilder.getInt64(0);
+        FdIndexes[1] = EntryBuilder.getInt64(i);
+        EntryBuilder.CreateStore(
+            EntryBuilder.CreateTrunc(Fd, Builder.getInt32Ty()),
+            EntryBuilder.CreateInBoundsGEP(PerfFds->getValueType(), PerfFds,
+                                           FdIndexes));
+    }
+
+    EntryBuilder.CreateRetVoid();
+
+    return PerfOpenFnc;
+}
+
+// PERF_EVENT_IOC_ENABLE, DISABLE or RESET on the whole group
+void Generator::addPerfIoctl(IRBuilder<> Builder, uint64_t Request) {
+    Function *IoctlFnc = Mod->getFunction("ioctl");
+    if (!IoctlFnc) {
+        vector<Type *> IoctlArgs(2);
+        IoctlArgs[0] = Builder.getInt32Ty();
+        IoctlArgs[1] = Builder.getInt64Ty();
+        FunctionType *IoctlFt =
+            FunctionType::get(Builder.getInt32Ty(), IoctlArgs, true);
+        IoctlFnc =
+            Function::Create(IoctlFt, Function::ExternalLinkage, "ioctl", Mod);
+        IoctlFnc->setCallingConv(CallingConv::C);
+    }
+
+    vector<Value *> FdIndexes(2);
+    FdIndexes[0] = Builder.getInt64(0);
+    FdIndexes[1] = Builder.getInt64(0);
+    vector<Value *> IoctlCallArgs(3);
+    IoctlCallArgs[0] = Builder.CreateLoad(Builder.CreateInBoundsGEP(
+        PerfFds->getValueType(), PerfFds, FdIndexes));
+    IoctlCallArgs[1] = Builder.getInt64(Request);
+    IoctlCallArgs[2] = Builder.getInt64(1);
+    Builder.CreateCall(IoctlFnc, IoctlCallArgs);
+}
+
+// reads every counter of the group in PerfValues, 0 when it is not open
+void Generator::addPerfRead(IRBuilder<> Builder) {
+    vector<Type *> ReadArgs(3);
+    ReadArgs[0] = Builder.getInt32Ty();
+    ReadArgs[1] = Builder.getInt8PtrTy();
+    ReadArgs[2] = Builder.getInt64Ty();
+    FunctionType *ReadFt =
+        FunctionType::get(Builder.getInt64Ty(), ReadArgs, false);
+    Function *ReadFnc = Mod->getFunction("read");
+    if (!ReadFnc) {
+        ReadFnc =
+            Function::Create(ReadFt, Function::ExternalLinkage, "read", Mod);
+        ReadFnc->setCallingConv(CallingConv::C);
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        vector<Value *> Indexes(2);
+        Indexes[0] = Builder.getInt64(0);
+        Indexes[1] = Builder.getInt64(i);
+        Value *Counter = Builder.CreateInBoundsGEP(PerfValues->getValueType(),
+                                                   PerfValues, Indexes);
+        Builder.CreateStore(Builder.getInt64(0), Counter);
+
+        vector<Value *> ReadCallArgs(3);
+        ReadCallArgs[0] = Builder.CreateLoad(Builder.CreateInBoundsGEP(
+            PerfFds->getValueType(), PerfFds, Indexes));
+        ReadCallArgs[1] =
+            Builder.CreateBitCast(Counter, Builder.getInt8PtrTy());
+        ReadCallArgs[2] = Builder.getInt64(sizeof(uint64_t));
+        Builder.CreateCall(ReadFnc, ReadCallArgs);
+    }
+}
+
+Function *Generator::addBenchCmpFunction(IRBuilder<> Builder) {
+    vector<Type *> CmpArgs(2);
+    CmpArgs[0] = Builder.getInt8PtrTy();
+    CmpArgs[1] = Builder.getInt8PtrTy();
+    FunctionType *CmpFt =
+        FunctionType::get(Builder.getInt32Ty(), CmpArgs, false);
+    Function *CmpFnc =
+        Function::Create(CmpFt, Function::InternalLinkage, "bench_cmp", Mod);
+    BasicBlock *Entry =
+        BasicBlock::Create(Builder.getContext(), "entry", CmpFnc);
+    IRBuilder<> EntryBuilder(Entry);
+
+    auto A = CmpFnc->arg_begin();
+    Value *XPtr = A++;
+    Value *YPtr = A;
+    Type *I64PtrTy = PointerType::getUnqual(Builder.getInt64Ty());
+    Value *X =
+        EntryBuilder.CreateLoad(EntryBuilder.CreateBitCast(XPtr, I64PtrTy));
+    Value *Y =
+        EntryBuilder.CreateLoad(EntryBuilder.CreateBitCast(YPtr, I64PtrTy));
+    Value *Gt = EntryBuilder.CreateZExt(EntryBuilder.CreateICmpSGT(X, Y),
+                                        Builder.getInt32Ty());
+    Value *Lt = EntryBuilder.CreateZExt(EntryBuilder.CreateICmpSLT(X, Y),
+                                        Builder.getInt32Ty());
+    EntryBuilder.CreateRet(EntryBuilder.CreateSub(Gt, Lt));
+
+    return CmpFnc;
+}
+
+// runs a test warmupRuns times, then times measuredRuns runs into the sorted
+// samples arrays, in ns and in cycles with -cycle-counter, the perf counters
+// cover all the measured runs
+Function *Generator::addBenchRunFunction(IRBuilder<> Builder) {
+    FunctionType *TestFt = FunctionType::get(Builder.getVoidTy(), false);
+    Type *I64PtrTy = PointerType::getUnqual(Builder.getInt64Ty());
+    bool UsePerf = PerfCounters && hasPerfEvent;
+    vector<Type *> RunArgs(3);
+    RunArgs[0] = PointerType::getUnqual(TestFt);
+    RunArgs[1] = I64PtrTy;
+    RunArgs[2] = I64PtrTy;
+    FunctionType *RunFt =
+        FunctionType::get(Builder.getVoidTy(), RunArgs, false);
+    Function *RunFnc =
+        Function::Create(RunFt, Function::InternalLinkage, "bench_run", Mod);
+
+    Function *CmpFnc = addBenchCmpFunction(Builder);
+    vector<Type *> QsortArgs(4);
+    QsortArgs[0] = Builder.getInt8PtrTy();
+    QsortArgs[1] = Builder.getInt64Ty();
+    QsortArgs[2] = Builder.getInt64Ty();
+    QsortArgs[3] = PointerType::getUnqual(CmpFnc->getFunctionType());
+    FunctionType *QsortFt =
+        FunctionType::get(Builder.getVoidTy(), QsortArgs, false);
+    Function *QsortFnc =
+        Function::Create(QsortFt, Function::ExternalLinkage, "qsort", Mod);
+    QsortFnc->setCallingConv(CallingConv::C);
+
+    auto A = RunFnc->arg_begin();
+    Value *TestPtr = A++;
+    Value *Samples = A++;
+    Value *CycleSamples = A;
+    ArrayRef<Value *> Args;
+
+    BasicBlock *Entry =
+        BasicBlock::Create(Builder.getContext(), "entry", RunFnc);
+    BasicBlock *Warm = BasicBlock::Create(Builder.getContext(), "warm", RunFnc);
+    BasicBlock *WarmBody =
+        BasicBlock::Create(Builder.getContext(), "warmbody", RunFnc);
+    BasicBlock *Measure =
+        BasicBlock::Create(Builder.getContext(), "measure", RunFnc);
+    BasicBlock *Rep = BasicBlock::Create(Builder.getContext(), "rep", RunFnc);
+    BasicBlock *RepBody =
+        BasicBlock::Create(Builder.getContext(), "repbody", RunFnc);
+    BasicBlock *End = BasicBlock::Create(Builder.getContext(), "end", RunFnc);
+
+    IRBuilder<> EntryBuilder(Entry);
+    AllocaInst *Slot = EntryBuilder.CreateAlloca(
+        hasClockGettime ? TimespecType : TimevalType, nullptr, "Slot");
+    Slot->setMetadata(Mod->getMDKindID("nosanitize"),
+                      MDNode::get(Builder.getContext(), None));
+    EntryBuilder.CreateBr(Warm);
+
+    IRBuilder<> WarmBuilder(Warm);
+    PHINode *I = WarmBuilder.CreatePHI(Builder.getInt64Ty(), 2, "I");
+    I->addIncoming(Builder.getInt64(0), Entry);
+    WarmBuilder.CreateCondBr(
+        WarmBuilder.CreateICmpSLT(I, Builder.getInt64(warmupRuns)), WarmBody,
+        Measure);
+
+    IRBuilder<> WarmBodyBuilder(WarmBody);
+    WarmBodyBuilder.CreateCall(TestFt, TestPtr, Args);
+    I->addIncoming(WarmBodyBuilder.CreateAdd(I, Builder.getInt64(1), "Nxt"),
+                   WarmBody);
+    WarmBodyBuilder.CreateBr(Warm);
+
+    IRBuilder<> MeasureBuilder(Measure);
+    if (UsePerf) {
+        addPerfIoctl(MeasureBuilder, 0x2403);
+        addPerfIoctl(MeasureBuilder, 0x2400);
+    }
+    MeasureBuilder.CreateBr(Rep);
+
+    IRBuilder<> RepBuilder(Rep);
+    PHINode *J = RepBuilder.CreatePHI(Builder.getInt64Ty(), 2, "J");
+    J->addIncoming(Builder.getInt64(0), Measure);
+    RepBuilder.CreateCondBr(
+        RepBuilder.CreateICmpSLT(J, Builder.getInt64(measuredRuns)), RepBody,
+        End);
+
+    IRBuilder<> RepBodyBuilder(RepBody);
+    Value *TestStart = addClockRead(RepBodyBuilder, Slot);
+    Value *CyclesStart = nullptr;
+    if (CycleCounter)
+        CyclesStart = addCycleRead(RepBodyBuilder);
+    RepBodyBuilder.CreateCall(TestFt, TestPtr, Args);
+    if (CycleCounter) {
+        Value *CyclesEnd = addCycleRead(RepBodyBuilder);
+        RepBodyBuilder.CreateStore(
+            RepBodyBuilder.CreateSub(CyclesEnd, CyclesStart, "Testcycles"),
+            RepBodyBuilder.CreateInBoundsGEP(Builder.getInt64Ty(), CycleSamples,
+                                             J));
+    }
+    Value *TestEnd = addClockRead(RepBodyBuilder, Slot);
+    RepBodyBuilder.CreateStore(
+        RepBodyBuilder.CreateSub(TestEnd, TestStart, "Testns"),
+        RepBodyBuilder.CreateInBoundsGEP(Builder.getInt64Ty(), Samples, J));
+    J->addIncoming(RepBodyBuilder.CreateAdd(J, Builder.getInt64(1), "Nxt"),
+                   RepBody);
+    RepBodyBuilder.CreateBr(Rep);
+
+    IRBuilder<> EndBuilder(End);
+    if (UsePerf) {
+        addPerfIoctl(EndBuilder, 0x2401);
+        addPerfRead(EndBuilder);
+    }
+    vector<Value *> QsortCallArgs(4);
+    QsortCallArgs[0] =
+        EndBuilder.CreateBitCast(Samples, Builder.getInt8PtrTy());
+    QsortCallArgs[1] = Builder.getInt64(measuredRuns);
+    QsortCallArgs[2] = Builder.getInt64(sizeof(int64_t));
+    QsortCallArgs[3] = CmpFnc;
+    EndBuilder.CreateCall(QsortFnc, QsortCallArgs);
+    if (CycleCounter) {
+        QsortCallArgs[0] =
+            EndBuilder.CreateBitCast(CycleSamples, Builder.getInt8PtrTy());
+        EndBuilder.CreateCall(QsortFnc, QsortCallArgs);
+    }
+    EndBuilder.CreateRetVoid();
+
+    return RunFnc;
+}
+
+// stores the mean and the standard deviation of the samples array
+Function *Generator::addBenchStatsFunction(IRBuilder<> Builder) {
+    Type *DblTy = Builder.getDoubleTy();
+    vector<Type *> StatsArgs(2);
+    StatsArgs[0] = PointerType::getUnqual(Builder.getInt64Ty());
+    StatsArgs[1] = PointerType::getUnqual(DblTy);
+    FunctionType *StatsFt =
+        FunctionType::get(Builder.getVoidTy(), StatsArgs, false);
+    Function *StatsFnc = Function::Create(StatsFt, Function::InternalLinkage,
+                                          "bench_stats", Mod);
+    Function *SqrtFnc = Intrinsic::getDeclaration(Mod, Intrinsic::sqrt, DblTy);
+
+    auto A = StatsFnc->arg_begin();
+    Value *Samples = A++;
+    Value *Out = A;
+    Value *N = ConstantFP::get(DblTy, static_cast<double>(measuredRuns));
+
+    BasicBlock *Entry =
+        BasicBlock::Create(Builder.getContext(), "entry", StatsFnc);
+    BasicBlock *Sum = BasicBlock::Create(Builder.getContext(), "sum", StatsFnc);
+    BasicBlock *Dev = BasicBlock::Create(Builder.getContext(), "dev", StatsFnc);
+    BasicBlock *End = BasicBlock::Create(Builder.getContext(), "end", StatsFnc);
+
+    IRBuilder<> EntryBuilder(Entry);
+    EntryBuilder.CreateBr(Sum);
+
+    IRBuilder<> SumBuilder(Sum);
+    PHINode *I = SumBuilder.CreatePHI(Builder.getInt64Ty(), 2, "I");
+    PHINode *Acc = SumBuilder.CreatePHI(DblTy, 2, "Acc");
+    Value *X = SumBuilder.CreateSIToFP(
+        SumBuilder.CreateLoad(
+            SumBuilder.CreateInBoundsGEP(Builder.getInt64Ty(), Samples, I)),
+        DblTy);
+    Value *NxtAcc = SumBuilder.CreateFAdd(Acc, X, "Nxtacc");
+    Value *NxtI = SumBuilder.CreateAdd(I, Builder.getInt64(1), "Nxt");
+    I->addIncoming(Builder.getInt64(0), Entry);
+    I->addIncoming(NxtI, Sum);
+    Acc->addIncoming(ConstantFP::get(DblTy, 0.0), Entry);
+    Acc->addIncoming(NxtAcc, Sum);
+    SumBuilder.CreateCondBr(
+        SumBuilder.CreateICmpSLT(NxtI, Builder.getInt64(measuredRuns)), Sum,
+        Dev);
+
+    IRBuilder<> DevBuilder(Dev);
+    PHINode *J = DevBuilder.CreatePHI(Builder.getInt64Ty(), 2, "J");
+    PHINode *Sq = DevBuilder.CreatePHI(DblTy, 2, "Sq");
+    Value *Mean = DevBuilder.CreateFDiv(NxtAcc, N, "Mean");
+    Value *D = DevBuilder.CreateFSub(
+        DevBuilder.CreateSIToFP(
+            DevBuilder.CreateLoad(
+                DevBuilder.CreateInBoundsGEP(Builder.getInt64Ty(), Samples, J)),
+            DblTy),
+        Mean);
+    Value *NxtSq = DevBuilder.CreateFAdd(Sq, DevBuilder.CreateFMul(D, D));
+    Value *NxtJ = DevBuilder.CreateAdd(J, Builder.getInt64(1), "Nxt");
+    J->addIncoming(Builder.getInt64(0), Sum);
+    J->addIncoming(NxtJ, Dev);
+    Sq->addIncoming(ConstantFP::get(DblTy, 0.0), Sum);
+    Sq->addIncoming(NxtSq, Dev);
+    DevBuilder.CreateCondBr(
+        DevBuilder.CreateICmpSLT(NxtJ, Builder.getInt64(measuredRuns)), Dev,
+        End);
+
+    IRBuilder<> EndBuilder(End);
+    vector<Value *> SqrtArgs(1);
+    SqrtArgs[0] = EndBuilder.CreateFDiv(NxtSq, N);
+    EndBuilder.CreateStore(Mean, Out);
+    EndBuilder.CreateStore(
+        EndBuilder.CreateCall(SqrtFnc, SqrtArgs),
+        EndBuilder.CreateInBoundsGEP(DblTy, Out, Builder.getInt64(1)));
+    EndBuilder.CreateRetVoid();
+
+    return StatsFnc;
+}
+
+// thread body of the scaling tests, waits for all its siblings then stores
+// the duration and start of one run of the workload in its ScaleArgType slot
+Function *Generator::addScaleWorkerFunction(IRBuilder<> Builder) {
+    vector<Type *> WorkerArgs(1);
+    WorkerArgs[0] = Builder.getInt8PtrTy();
+    FunctionType *WorkerFt =
+        FunctionType::get(Builder.getInt8PtrTy(), WorkerArgs, false);
+    Function *WorkerFnc = Function::Create(WorkerFt, Function::InternalLinkage,
+                                           "scale_worker", Mod);
+    FunctionType *YieldFt = FunctionType::get(Builder.getInt32Ty(), false);
+    Function *YieldFnc = Function::Create(YieldFt, Function::ExternalLinkage,
+                                          "sched_yield", Mod);
+    YieldFnc->setCallingConv(CallingConv::C);
+    FunctionType *TestFt = FunctionType::get(Builder.getVoidTy(), false);
+    ArrayRef<Value *> Args;
+
+    BasicBlock *Entry =
+        BasicBlock::Create(Builder.getContext(), "entry", WorkerFnc);
+    BasicBlock *Spin =
+        BasicBlock::Create(Builder.getContext(), "spin", WorkerFnc);
+    BasicBlock *Run =
+        BasicBlock::Create(Builder.getContext(), "run", WorkerFnc);
+
+    IRBuilder<> EntryBuilder(Entry);
+    AllocaInst *Slot = EntryBuilder.CreateAlloca(
+        hasClockGettime ? TimespecType : TimevalType, nullptr, "Slot");
+    Slot->setMetadata(Mod->getMDKindID("nosanitize"),
+                      MDNode::get(Builder.getContext(), None));
+    Value *Arg = EntryBuilder.CreateBitCast(
+        WorkerFnc->arg_begin(), PointerType::getUnqual(ScaleArgType), "Arg");
+    Value *TestPtr = EntryBuilder.CreateLoad(
+        EntryBuilder.CreateStructGEP(ScaleArgType, Arg, 0), "Testptr");
+    Value *Workers = EntryBuilder.CreateLoad(
+        EntryBuilder.CreateStructGEP(ScaleArgType, Arg, 1), "Workers");
+    EntryBuilder.CreateAtomicRMW(AtomicRMWInst::Add, ScaleReady,
+                                 Builder.getInt64(1),
+                                 AtomicOrdering::SequentiallyConsistent);
+    EntryBuilder.CreateBr(Spin);
+
+    IRBuilder<> SpinBuilder(Spin);
+    LoadInst *Ready = SpinBuilder.CreateLoad(ScaleReady, "Ready");
+    Ready->setVolatile(true);
+    Value *Waiting = SpinBuilder.CreateICmpULT(Ready, Workers);
+    SpinBuilder.CreateCall(YieldFnc);
+    SpinBuilder.CreateCondBr(Waiting, Spin, Run);
+
+    IRBuilder<> RunBuilder(Run);
+    Value *TestStart = addClockRead(RunBuilder, Slot);
+    RunBuilder.CreateCall(TestFt, TestPtr, Args);
+    Value *TestEnd = addClockRead(RunBuilder, Slot);
+    RunBuilder.CreateStore(RunBuilder.CreateSub(TestEnd, TestStart, "Testns"),
+                           RunBuilder.CreateStructGEP(ScaleArgType, Arg, 2));
+    RunBuilder.CreateStore(TestStart,
+                           RunBuilder.CreateStructGEP(ScaleArgType, Arg, 3));
+    RunBuilder.CreateRet(Constant::getNullValue(Builder.getInt8PtrTy()));
+
+    return WorkerFnc;
+}
+
+// starts Workers threads on the same workload behind the ScaleReady barrier
+Function *Generator::addScaleTest(IRBuilder<> Builder, string Workload,
+                                  Function *TestFnc, Value *Iterations,
+                                  uint64_t Workers) {
+    FunctionType *Ft = FunctionType::get(Builder.getVoidTy(), false);
+    Function *ScaleFnc =
+        Function::Create(Ft, Function::InternalLinkage,
+                         "scale_" + Workload + "_" + to_string(Workers), Mod);
+    Function *WorkerFnc = Mod->getFunction("scale_worker");
+    if (!WorkerFnc)
+        WorkerFnc = addScaleWorkerFunction(Builder);
+    Function *PthreadCreateFnc = Mod->getFunction("pthread_create");
+    Function *PthreadJoinFnc = Mod->getFunction("pthread_join");
+    ArrayType *ArgsType = ArrayType::get(ScaleArgType, Workers);
+    GlobalVariable *ScaleArgs = new GlobalVariable(
+        *Mod, ArgsType, false, GlobalVariable::PrivateLinkage,
+        ConstantAggregateZero::get(ArgsType), "Scaleargs");
+    Value *N = Builder.getInt64(Workers);
+
+    BasicBlock *Entry =
+        BasicBlock::Create(Builder.getContext(), "entry", ScaleFnc);
+    BasicBlock *Create =
+        BasicBlock::Create(Builder.getContext(), "create", ScaleFnc);
+    BasicBlock *Join =
+        BasicBlock::Create(Builder.getContext(), "join", ScaleFnc);
+    BasicBlock *End = BasicBlock::Create(Builder.getContext(), "end", ScaleFnc);
+
+    IRBuilder<> EntryBuilder(Entry);
+    AllocaInst *Tds = EntryBuilder.CreateAlloca(
+        PointerType::getUnqual(PthreadType), N, "Tds");
+    EntryBuilder.CreateStore(Builder.getInt64(0), ScaleReady);
+    EntryBuilder.CreateBr(Create);
+
+    IRBuilder<> CreateBuilder(Create);
+    PHINode *I = CreateBuilder.CreatePHI(Builder.getInt64Ty(), 2, "I");
+    I->addIncoming(Builder.getInt64(0), Entry);
+    vector<Value *> ArgIndexes(2);
+    ArgIndexes[0] = Builder.getInt64(0);
+    ArgIndexes[1] = I;
+    Value *Arg = CreateBuilder.CreateInBoundsGEP(ArgsType, ScaleArgs,
+                                                 ArgIndexes, "Arg");
+    CreateBuilder.CreateStore(
+        TestFnc, CreateBuilder.CreateStructGEP(ScaleArgType, Arg, 0));
+    CreateBuilder.CreateStore(
+        N, CreateBuilder.CreateStructGEP(ScaleArgType, Arg, 1));
+    vector<Value *> PthreadCreateCallArgs(4);
+    PthreadCreateCallArgs[0] = CreateBuilder.CreateInBoundsGEP(
+        PointerType::getUnqual(PthreadType), Tds, I);
+    PthreadCreateCallArgs[1] = Constant::getNullValue(
+        PointerType::get(PointerType::getUnqual(PthreadAttrType), 0));
+    PthreadCreateCallArgs[2] = WorkerFnc;
+    PthreadCreateCallArgs[3] =
+        CreateBuilder.CreateBitCast(Arg, Builder.getInt8PtrTy());
+    CreateBuilder.CreateCall(PthreadCreateFnc, PthreadCreateCallArgs);
+    Value *NxtI = CreateBuilder.CreateAdd(I, Builder.getInt64(1), "Nxt");
+    I->addIncoming(NxtI, Create);
+    CreateBuilder.CreateCondBr(CreateBuilder.CreateICmpULT(NxtI, N), Create,
+                               Join);
+
+    IRBuilder<> JoinBuilder(Join);
+    PHINode *J = JoinBuilder.CreatePHI(Builder.getInt64Ty(), 2, "J");
+    J->addIncoming(Builder.getInt64(0), Create);
+    vector<Value *> PthreadJoinCallArgs(2);
+    Value *Td = JoinBuilder.CreateInBoundsGEP(
+        PointerType::getUnqual(PthreadType), Tds, J);
+    PthreadJoinCallArgs[0] = JoinBuilder.CreateLoad(Td, "Td");
+    PthreadJoinCallArgs[1] =
+        Constant::getNullValue(PointerType::get(Builder.getInt8PtrTy(), 0));
+    JoinBuilder.CreateCall(PthreadJoinFnc, PthreadJoinCallArgs);
+    Value *NxtJ = JoinBuilder.CreateAdd(J, Builder.getInt64(1), "Nxt");
+    J->addIncoming(NxtJ, Join);
+    JoinBuilder.CreateCondBr(JoinBuilder.CreateICmpULT(NxtJ, N), Join, End);
+
+    ReturnInst::Create(Builder.getContext(), nullptr, End);
+
+    ScaleTests.push_back({Workload, Workers, ScaleFnc, ScaleArgs, Iterations});
+
+    return ScaleFnc;
+}
+
+Function *Generator::addMain(IRBuilder<> Builder) {
     FunctionType *Ft = FunctionType::get(Builder.getInt32Ty(), false);
     Function *MainFnc =
         Function::Create(Ft, Function::ExternalLinkage, "main", Mod);
@@ -1186,7 +2148,7 @@ Function *addMain(IRBuilder<> Builder) {
     return MainFnc;
 }
 
-void addMainBlock(IRBuilder<> Builder, Function *MainFnc) {
+void Generator::addMainBlock(IRBuilder<> Builder, Function *MainFnc) {
     BasicBlock *MainEntry =
         BasicBlock::Create(Builder.getContext(), "entry", MainFnc);
     Builder.SetInsertPoint(MainEntry);
@@ -1402,15 +2364,7 @@ void addMainBlock(IRBuilder<> Builder, Function *MainFnc) {
     vector<Value *> TimeArgs(2);
 
     if (hasClockGettime) {
-        vector<Type *> ClockTypes(2);
-        ClockTypes[0] = Type::getInt32Ty(Builder.getContext());
-        ClockTypes[1] = PointerType::getUnqual(TimespecType);
-
-        FunctionType *ClockFt = FunctionType::get(
-            Type::getInt32Ty(Builder.getContext()), ClockTypes, false);
-        Function *ClockGettime = Function::Create(
-            ClockFt, Function::ExternalLinkage, "clock_gettime", Mod);
-        ClockGettime->setCallingConv(CallingConv::C);
+        Function *ClockGettime = addClockFunction(Builder);
 
         AStart = Builder.CreateAlloca(TimespecType, nullptr, "Astart");
         AStart->setMetadata(Mod->getMDKindID("nosanitize"),
@@ -1424,15 +2378,7 @@ void addMainBlock(IRBuilder<> Builder, Function *MainFnc) {
 
         CStartInst = Builder.CreateCall(ClockGettime, TimeArgs);
     } else {
-        vector<Type *> GettimeTypes(2);
-        GettimeTypes[0] = PointerType::getUnqual(TimevalType);
-        GettimeTypes[1] = Builder.getInt8PtrTy();
-
-        FunctionType *GettimeFt = FunctionType::get(
-            Type::getInt32Ty(Builder.getContext()), GettimeTypes, false);
-        Function *Gettimeofday = Function::Create(
-            GettimeFt, Function::ExternalLinkage, "gettimeofday", Mod);
-        Gettimeofday->setCallingConv(CallingConv::C);
+        Function *Gettimeofday = addClockFunction(Builder);
 
         AStart = Builder.CreateAlloca(TimevalType, nullptr, "Astart");
         AEnd = Builder.CreateAlloca(TimevalType, nullptr, "Aend");
@@ -1445,10 +2391,72 @@ void addMainBlock(IRBuilder<> Builder, Function *MainFnc) {
 
     CStartInst->setMetadata(Mod->getMDKindID("nosanitize"),
                             MDNode::get(Builder.getContext(), None));
-    ArrayRef<Value *> Args;
+    Function *BenchRunFnc = addBenchRunFunction(Builder);
+    Function *BenchStatsFnc = addBenchStatsFunction(Builder);
+    AllocaInst *ASamples = Builder.CreateAlloca(
+        Builder.getInt64Ty(), Builder.getInt64(measuredRuns), "Asamples");
+    AllocaInst *AStats = Builder.CreateAlloca(
+        Builder.getDoubleTy(), Builder.getInt64(2), "Astats");
+    AllocaInst *ACycles = Builder.CreateAlloca(
+        Builder.getInt64Ty(), Builder.getInt64(measuredRuns), "Acycles");
+    bool UsePerf = PerfCounters && hasPerfEvent;
+    if (UsePerf)
+        Builder.CreateCall(addPerfOpenFunction(Builder));
+    // nearest rank percentiles of the sorted samples
+    const int64_t Ranks[] = {0, (measuredRuns * 50 + 99) / 100 - 1,
+                             (measuredRuns * 90 + 99) / 100 - 1,
+                             (measuredRuns * 99 + 99) / 100 - 1,
+                             measuredRuns - 1};
+    vector<vector<Value *>> TestStats;
+    vector<vector<Value *>> TestCounters;
+
+    for (const auto Fnc : TestFunctions) {
+        vector<Value *> BenchArgs(3);
+        BenchArgs[0] = Fnc;
+        BenchArgs[1] = ASamples;
+        BenchArgs[2] = ACycles;
+        Builder.CreateCall(BenchRunFnc, BenchArgs);
+        BenchArgs.resize(2);
+        BenchArgs[0] = ASamples;
+        BenchArgs[1] = AStats;
+        Builder.CreateCall(BenchStatsFnc, BenchArgs);
+
+        vector<Value *> Counters;
+        if (CycleCounter)
+            Counters.push_back(Builder.CreateLoad(Builder.CreateInBoundsGEP(
+                Builder.getInt64Ty(), ACycles, Builder.getInt64(Ranks[1]))));
+        for (size_t c = 0; UsePerf && c < 4; c++) {
+            vector<Value *> Indexes(2);
+            Indexes[0] = Builder.getInt64(0);
+            Indexes[1] = Builder.getInt64(c);
+            Counters.push_back(Builder.CreateUDiv(
+                Builder.CreateLoad(Builder.CreateInBoundsGEP(
+                    PerfValues->getValueType(), PerfValues, Indexes)),
+                Builder.getInt64(measuredRuns)));
+        }
+        TestCounters.push_back(Counters);
+
+        vector<Value *> Stats;
+        for (auto Rank : Ranks)
+            Stats.push_back(Builder.CreateLoad(Builder.CreateInBoundsGEP(
+                Builder.getInt64Ty(), ASamples, Builder.getInt64(Rank))));
+        Stats.push_back(Builder.CreateLoad(AStats));
+        Stats.push_back(Builder.CreateLoad(Builder.CreateInBoundsGEP(
+            Builder.getDoubleTy(), AStats, Builder.getInt64(1))));
+        TestStats.push_back(Stats);
+    }
 
-    for (const auto Fnc : TestFunctions)
-        Builder.CreateCall(Fnc, Args);
+    vector<Value *> ScaleWalls;
+
+    for (const auto &Scale : ScaleTests) {
+        vector<Value *> BenchArgs(3);
+        BenchArgs[0] = Scale.Fnc;
+        BenchArgs[1] = ASamples;
+        BenchArgs[2] = ACycles;
+        Builder.CreateCall(BenchRunFnc, BenchArgs);
+        ScaleWalls.push_back(Builder.CreateLoad(Builder.CreateInBoundsGEP(
+            Builder.getInt64Ty(), ASamples, Builder.getInt64(Ranks[1]))));
+    }
 
     if (hasClockGettime) {
         Function *ClockGettime = Mod->getFunction("clock_gettime");
@@ -1584,21 +2592,79 @@ void addMainBlock(IRBuilder<> Builder, Function *MainFnc) {
     if (ForkMod)
         ::strlcat(buffer, " fork", sizeof(buffer));
 
-    Value *ResultFmt = Builder.CreateGlobalStringPtr(
+    string ResultFmtStr =
         "{\"%s\":{\"cpufeatures\":\"%s\",\"auxvec\":\"%d "
-        "%d\",\"numtests\":%lld,\"iterations\":%lld,"
+        "%d\",\"numtests\":%lld,\"iterations\":%lld,\"warmup\":%lld,"
+        "\"repetitions\":%lld,"
         "\"time\":%lld,\"total_allocated\":%lld,\"real_size\":%lld,\"usable_"
         "size\":%lld,\"string_buffer\":\"%s\",\"strlcpy_bytes_copied\":%lld,"
         "\"strlcat_bytes_copied\":%lld,"
-        "\"buffer\":\"%s\",\"buffer_size\":%lld,\"page_size\":%lld,"
+        "\"buffer\":\"%016llx\",\"buffer_size\":%lld,\"page_size\":%lld,"
         "\"random_value\":%ld,\"sec_return\":%d,\"sec_settings\":\"%s\","
         "\"thread_return\":%d,\"thread_setname_return\":%d,\"memcmp_ret\":%d,"
         "\"bcmp_ret\":%d,\"thread_name\":\"%"
         "s\",\"orig_thread_name\":\"%s\",\"last_error\":%d,\"str_last_error\":"
         "\"%s\","
         "\"pointer_size\":%lld,"
-        "\"pointer_double_size\":%lld,\"features_supported\":\"%s\"}}",
-        "Resultfmt");
+        "\"pointer_double_size\":%lld,\"features_supported\":\"%s\","
+        "\"tests\":[";
+
+    for (size_t i = 0; i < TestFunctions.size(); i++) {
+        if (i > 0)
+            ResultFmtStr += ",";
+        ResultFmtStr += "{\"name\":\"" + TestFunctions[i]->getName().str() +
+                        "\",\"iterations\":%lld,\"min_ns\":%lld,"
+                        "\"median_ns\":%lld,\"p90_ns\":%lld,"
+                        "\"p99_ns\":%lld,\"max_ns\":%lld,"
+                        "\"mean_ns\":%.1f,\"stddev_ns\":%.1f,"
+                        "\"ns_per_iter\":%.3f,\"iter_per_sec\":%.1f";
+        if (CycleCounter)
+            ResultFmtStr += ",\"cycles\":%lld,\"cycles_per_iter\":%.2f";
+        if (UsePerf)
+            ResultFmtStr += ",\"perf\":{\"cycles\":%lld,\"instructions\":%lld,"
+                            "\"cache_misses\":%lld,\"branch_misses\":%lld,"
+                            "\"cycles_per_iter\":%.2f,\"ipc\":%.3f}";
+        ResultFmtStr += "}";
+    }
+
+    ResultFmtStr += "],\"overhead\":[";
+
+    // one latency curve per primitive, the sizes of a primitive are adjacent
+    for (size_t i = 0; i < PairTests.size(); i++) {
+        bool First = (i == 0 || PairTests[i - 1].Prim != PairTests[i].Prim);
+        bool Last = (i + 1 == PairTests.size() ||
+                     PairTests[i + 1].Prim != PairTests[i].Prim);
+
+        if (First)
+            ResultFmtStr += string(i > 0 ? "," : "") + "{\"primitive\":\"" +
+                            PairTests[i].Prim + "\",\"curve\":[";
+        else
+            ResultFmtStr += ",";
+        ResultFmtStr += "{\"size\":" + to_string(PairTests[i].Size) +
+                        ",\"libc_ns\":%lld,\"safe_ns\":%lld,"
+                        "\"libc_ns_per_op\":%.2f,\"safe_ns_per_op\":%.2f,"
+                        "\"ratio\":%.3f}";
+        if (Last)
+            ResultFmtStr += "]}";
+    }
+
+    ResultFmtStr += "],\"scaling\":[";
+
+    for (size_t i = 0; i < ScaleTests.size(); i++) {
+        ResultFmtStr += string(i > 0 ? "," : "") + "{\"workload\":\"" +
+                        ScaleTests[i].Workload +
+                        "\",\"threads\":" + to_string(ScaleTests[i].Threads) +
+                        ",\"iterations\":%lld,\"wall_ns\":%lld,"
+                        "\"thread_ns\":[";
+        for (uint64_t t = 0; t < ScaleTests[i].Threads; t++)
+            ResultFmtStr += t > 0 ? ",%lld" : "%lld";
+        ResultFmtStr += "],\"thread_ops_per_sec\":%.1f,"
+                        "\"aggregate_ops_per_sec\":%.1f}";
+    }
+
+    ResultFmtStr += "]}}";
+
+    Value *ResultFmt = Builder.CreateGlobalStringPtr(ResultFmtStr, "Resultfmt");
 
     Value *TargetTripleRef =
         Builder.CreateGlobalStringPtr(targetTriple, "Targettriple");
@@ -1625,6 +2691,8 @@ void addMainBlock(IRBuilder<> Builder, Function *MainFnc) {
     PrintfCallArgs.push_back(Builder.CreateLoad(AuxVec2));
     PrintfCallArgs.push_back(Builder.getInt64(TestFunctions.size()));
     PrintfCallArgs.push_back(Lim);
+    PrintfCallArgs.push_back(Builder.getInt64(warmupRuns));
+    PrintfCallArgs.push_back(Builder.getInt64(measuredRuns));
     PrintfCallArgs.push_back(Res);
     PrintfCallArgs.push_back(Builder.CreateLoad(TotalAllocated));
     PrintfCallArgs.push_back(Builder.CreateLoad(RealSize));
@@ -1650,12 +2718,136 @@ void addMainBlock(IRBuilder<> Builder, Function *MainFnc) {
     PrintfCallArgs.push_back(Builder.CreateLoad(PtrDblSize));
     PrintfCallArgs.push_back(OsFeaturesRef);
 
+    for (size_t i = 0; i < TestFunctions.size(); i++) {
+        // a timer coarser than the test would divide by zero
+        Value *Median = TestStats[i][1];
+        Value *TestNs = Builder.CreateSelect(
+            Builder.CreateICmpSLT(Median, Builder.getInt64(1)),
+            Builder.getInt64(1), Median);
+        Value *TestNsF = Builder.CreateSIToFP(TestNs, Builder.getDoubleTy());
+        Value *TestItF =
+            Builder.CreateSIToFP(TestIterations[i], Builder.getDoubleTy());
+
+        PrintfCallArgs.push_back(TestIterations[i]);
+        for (auto Stat : TestStats[i])
+            PrintfCallArgs.push_back(Stat);
+        PrintfCallArgs.push_back(Builder.CreateFDiv(TestNsF, TestItF));
+        PrintfCallArgs.push_back(Builder.CreateFDiv(
+            Builder.CreateFMul(TestItF, ConstantFP::get(Builder.getDoubleTy(),
+                                                        1e9)),
+            TestNsF));
+
+        auto Counter = TestCounters[i].begin();
+        if (CycleCounter) {
+            Value *Cycles = *Counter++;
+            PrintfCallArgs.push_back(Cycles);
+            PrintfCallArgs.push_back(Builder.CreateFDiv(
+                Builder.CreateUIToFP(Cycles, Builder.getDoubleTy()), TestItF));
+        }
+        if (UsePerf) {
+            Value *Cycles = Counter[0];
+            Value *CyclesF = Builder.CreateUIToFP(
+                Builder.CreateSelect(
+                    Builder.CreateICmpEQ(Cycles, Builder.getInt64(0)),
+                    Builder.getInt64(1), Cycles),
+                Builder.getDoubleTy());
+            PrintfCallArgs.insert(PrintfCallArgs.end(), Counter, Counter + 4);
+            PrintfCallArgs.push_back(Builder.CreateFDiv(
+                Builder.CreateUIToFP(Cycles, Builder.getDoubleTy()), TestItF));
+            PrintfCallArgs.push_back(Builder.CreateFDiv(
+                Builder.CreateUIToFP(Counter[1], Builder.getDoubleTy()),
+                CyclesF));
+        }
+    }
+
+    for (const auto &Pair : PairTests) {
+        Value *LibcNs = TestStats[Pair.Index][1];
+        Value *SafeNs = TestStats[Pair.Index + 1][1];
+        Value *LibcNsF = Builder.CreateSIToFP(
+            Builder.CreateSelect(
+                Builder.CreateICmpSLT(LibcNs, Builder.getInt64(1)),
+                Builder.getInt64(1), LibcNs),
+            Builder.getDoubleTy());
+        Value *SafeNsF = Builder.CreateSIToFP(SafeNs, Builder.getDoubleTy());
+        Value *RoundsF = Builder.CreateSIToFP(TestIterations[Pair.Index],
+                                              Builder.getDoubleTy());
+
+        PrintfCallArgs.push_back(LibcNs);
+        PrintfCallArgs.push_back(SafeNs);
+        PrintfCallArgs.push_back(Builder.CreateFDiv(
+            Builder.CreateSIToFP(LibcNs, Builder.getDoubleTy()), RoundsF));
+        PrintfCallArgs.push_back(Builder.CreateFDiv(SafeNsF, RoundsF));
+        PrintfCallArgs.push_back(Builder.CreateFDiv(SafeNsF, LibcNsF));
+    }
+
+    for (size_t i = 0; i < ScaleTests.size(); i++) {
+        const auto &Scale = ScaleTests[i];
+        Value *ItF =
+            Builder.CreateSIToFP(Scale.Iterations, Builder.getDoubleTy());
+        Value *PerThread = ConstantFP::get(Builder.getDoubleTy(), 0.0);
+        Value *First = nullptr;
+        Value *Last = nullptr;
+        vector<Value *> ThreadNs;
+
+        for (uint64_t t = 0; t < Scale.Threads; t++) {
+            vector<Value *> NsIndexes(3);
+            NsIndexes[0] = Builder.getInt64(0);
+            NsIndexes[1] = Builder.getInt64(t);
+            NsIndexes[2] = Builder.getInt32(2);
+            Value *Ns = Builder.CreateLoad(Builder.CreateInBoundsGEP(
+                Scale.Args->getValueType(), Scale.Args, NsIndexes));
+            NsIndexes[2] = Builder.getInt32(3);
+            Value *Start = Builder.CreateLoad(Builder.CreateInBoundsGEP(
+                Scale.Args->getValueType(), Scale.Args, NsIndexes));
+            Value *End = Builder.CreateAdd(Start, Ns);
+            Value *NsF = Builder.CreateSIToFP(
+                Builder.CreateSelect(
+                    Builder.CreateICmpSLT(Ns, Builder.getInt64(1)),
+                    Builder.getInt64(1), Ns),
+                Builder.getDoubleTy());
+            PerThread = Builder.CreateFAdd(PerThread,
+                                           Builder.CreateFDiv(ItF, NsF));
+            if (t == 0) {
+                First = Start;
+                Last = End;
+            } else {
+                First = Builder.CreateSelect(
+                    Builder.CreateICmpSLT(Start, First), Start, First);
+                Last = Builder.CreateSelect(Builder.CreateICmpSGT(End, Last),
+                                            End, Last);
+            }
+            ThreadNs.push_back(Ns);
+        }
+
+        Value *Span = Builder.CreateSub(Last, First);
+        Span = Builder.CreateSelect(
+            Builder.CreateICmpSLT(Span, Builder.getInt64(1)),
+            Builder.getInt64(1), Span);
+
+        Value *Giga = ConstantFP::get(Builder.getDoubleTy(), 1e9);
+        Value *Threads = ConstantFP::get(Builder.getDoubleTy(),
+                                         static_cast<double>(Scale.Threads));
+
+        PrintfCallArgs.push_back(Scale.Iterations);
+        PrintfCallArgs.push_back(ScaleWalls[i]);
+        PrintfCallArgs.insert(PrintfCallArgs.end(), ThreadNs.begin(),
+                              ThreadNs.end());
+        PrintfCallArgs.push_back(
+            Builder.CreateFDiv(Builder.CreateFMul(PerThread, Giga), Threads));
+        // from the first worker start to the last worker end, so workers
+        // that did not actually overlap do not count as scaling
+        PrintfCallArgs.push_back(Builder.CreateFDiv(
+            Builder.CreateFMul(Builder.CreateFMul(ItF, Threads), Giga),
+            Builder.CreateSIToFP(Span, Builder.getDoubleTy())));
+    }
+
     Builder.CreateCall(PrintfFnc, PrintfCallArgs);
 
     ReturnInst::Create(Builder.getContext(), Builder.getInt32(0), MainEntry);
 }
 
-void compileObjectFile(TargetMachine *targetMachine, string FileName) {
+void Generator::compileObjectFile(TargetMachine *targetMachine,
+                                  string FileName) {
     legacy::PassManager pass;
     error_code EC;
 #if LLVM_VERSION_MAJOR >= 10
@@ -1679,8 +2871,74 @@ void compileObjectFile(TargetMachine *targetMachine, string FileName) {
     obj.flush();
 }
 
-int tasks(void *oBuilder) {
-    outs() << __func__ << " start\n";
+// the tests only measure the primitives once the harness is optimised,
+// the AlwaysInline helpers included
+bool Generator::optimize(void) {
+#if LLVM_VERSION_MAJOR >= 9
+#if LLVM_VERSION_MAJOR >= 14
+    using Level = OptimizationLevel;
+#else
+    using Level = PassBuilder::OptimizationLevel;
+#endif
+    string irlevel = IrLevel.empty() ? OptLevel : IrLevel;
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    ModulePassManager MPM;
+    PassBuilder PB(targetMachine.get());
+
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    if (!Passes.empty()) {
+        if (auto Err = PB.parsePassPipeline(MPM, Passes)) {
+            errs() << "Invalid -passes: " << toString(std::move(Err)) << "\n";
+            return false;
+        }
+    } else if (irlevel.size() != 1 || !::strchr("0123sz", irlevel[0])) {
+        errs() << "Invalid -ir-level " << irlevel << "\n";
+        return false;
+    } else if (irlevel == "0") {
+        MPM.addPass(AlwaysInlinerPass());
+    } else {
+        Level L = irlevel == "1"   ? Level::O1
+                  : irlevel == "2" ? Level::O2
+                  : irlevel == "3" ? Level::O3
+                  : irlevel == "s" ? Level::Os
+                                   : Level::Oz;
+        // the link step does the inlining across operands and libs
+        if (Lto == "thin")
+            MPM = PB.buildThinLTOPreLinkDefaultPipeline(L);
+        else if (Lto == "full")
+            MPM = PB.buildLTOPreLinkDefaultPipeline(L);
+        else
+            MPM = PB.buildPerModuleDefaultPipeline(L);
+    }
+
+    MPM.run(*Mod, MAM);
+
+    if (verifyModule(*Mod, &errs())) {
+        errs() << "The optimised module is broken\n";
+        return false;
+    }
+
+    return true;
+#else
+    if (!Passes.empty() || !IrLevel.empty()) {
+        errs() << "-passes and -ir-level need LLVM 9 or later\n";
+        return false;
+    }
+
+    return true;
+#endif
+}
+
+int Generator::tasks(void *oBuilder) {
+    *Out << __func__ << " start\n";
     IRBuilder<> *tBuilder = reinterpret_cast<IRBuilder<> *>(oBuilder);
     IRBuilder<> Builder = *tBuilder;
     vector<Type *> PrintfArgs(1);
@@ -1755,42 +3013,59 @@ int tasks(void *oBuilder) {
     addMTTestBlock(Builder, "mthread", TestFnc);
     verifyFunction(*TestFnc);
 
+    vector<string> PairPrims = {"memset", "bcmp",    "memmem",
+                                "malloc", "realloc", "calloc"};
+    if (hasExplicitBzero)
+        PairPrims.push_back("bzero");
+
+    for (const auto &Prim : PairPrims) {
+        for (auto Sz : sweepSizes) {
+            TestFnc = addPairTest(Builder, Prim, Sz, false);
+            verifyFunction(*TestFnc);
+            TestFnc = addPairTest(Builder, Prim, Sz, true);
+            verifyFunction(*TestFnc);
+        }
+    }
+
+    // allocator and randomness contention, on the first swept size
+    string ScaleSz = to_string(sweepSizes[0]);
+    vector<pair<string, Function *>> Workloads = {
+        {"malloc_safe", Mod->getFunction("pair_malloc_safe_" + ScaleSz)},
+        {"malloc_libc", Mod->getFunction("pair_malloc_libc_" + ScaleSz)},
+        {"randomness", Mod->getFunction("test_randomness")}};
+
+    for (const auto &Workload : Workloads) {
+        auto It = find(TestFunctions.begin(), TestFunctions.end(),
+                       Workload.second);
+        Value *Iterations = TestIterations[It - TestFunctions.begin()];
+
+        for (auto Workers : scaleThreads) {
+            TestFnc = addScaleTest(Builder, Workload.first, Workload.second,
+                                   Iterations, Workers);
+            verifyFunction(*TestFnc);
+        }
+    }
+
     Function *MainFnc = addMain(Builder);
     addMainBlock(Builder, MainFnc);
     verifyFunction(*MainFnc);
 
     setFunctionAttributes(targetCpu, targetFeatures, *Mod);
-    outs() << __func__ << " end\n";
+    *Out << __func__ << " end\n";
 
     return 0;
 }
 
-int main(int argc, char **argv) {
-    llvm_shutdown_obj Exit;
-    InitializeAllTargetInfos();
-    InitializeAllTargets();
-    InitializeAllTargetMCs();
-    InitializeAllAsmParsers();
-    InitializeAllAsmPrinters();
-
-    cl::ParseCommandLineOptions(argc, argv, "FrontEnd multipass");
-    cl::PrintOptionValues();
-
-    LLVMContext lctx;
-    IRBuilder<> Builder(lctx);
-    Mod = new Module("mpass", lctx);
-
+bool Generator::setup(void) {
+    IRBuilder<> &Builder = RootBuilder;
     string Error;
     TargetOptions opt;
 
-    if (TargetTriple != "")
-        targetTriple = TargetTriple;
-
     auto currentTarget = TargetRegistry::lookupTarget(targetTriple, Error);
 
     if (!currentTarget) {
         errs() << "Invalid target\n";
-        return 0;
+        return false;
     }
 
     const char *targetTripleStr = targetTriple.c_str();
@@ -1871,19 +3146,20 @@ int main(int argc, char **argv) {
         break;
     }
 
-    if (getCPUStr() != "")
+    if (getCPUStr() != "" && !targetCpuSet)
         targetCpu = getCPUStr();
 
     if (!NoCpuFeatures) {
         if (getFeaturesStr() != "") {
             targetFeatures = getFeaturesStr();
-        } else {
+        } else if (!targetCpuSet) {
+            // host features, a named target cpu implies its own
             StringMap<bool> HostFeatures;
             SubtargetFeatures Sb;
 
             if (!sys::getHostCPUFeatures(HostFeatures)) {
                 errs() << "Could not get CPU features\n";
-                return 0;
+                return false;
             }
 
             for (auto &Feature : HostFeatures)
@@ -1894,7 +3170,7 @@ int main(int argc, char **argv) {
     }
 
     Mod->setPIELevel(PIELevel::Default);
-    auto targetMachine =
+    targetMachine =
         unique_ptr<llvm::TargetMachine>(currentTarget->createTargetMachine(
             targetTriple, targetCpu, targetFeatures, opt, relocModel, codeModel,
             optLevel));
@@ -1923,11 +3199,29 @@ int main(int argc, char **argv) {
     hasTimingsafeCmp = isFreeBSD | isOpenBSD;
     hasConsttimeMemequal = isNetBSD;
 
+    Triple::ArchType targetArch = Triple(targetTriple).getArch();
+    hasLfence = targetArch == Triple::x86_64 || targetArch == Triple::x86;
+    if (targetArch == Triple::x86_64)
+        perfEventOpenId = 298;
+    else if (targetArch == Triple::aarch64 || targetArch == Triple::riscv64)
+        perfEventOpenId = 241;
+    else if (targetArch == Triple::x86)
+        perfEventOpenId = 336;
+    else if (targetArch == Triple::arm)
+        perfEventOpenId = 364;
+    else if (targetArch == Triple::ppc64 || targetArch == Triple::ppc64le)
+        perfEventOpenId = 319;
+    hasPerfEvent = isLinux && perfEventOpenId;
+
     randomStrLen = ::random() % 64;
     randomStr = std::make_unique<char[]>(randomStrLen + 1);
     ::memset(randomStr.get(), 0, randomStrLen);
-    for (auto x = 0; x < randomStrLen; x++)
+    for (auto x = 0; x < randomStrLen; x++) {
         randomStr.get()[x] = (arc4random() % 68) + 48;
+        // printed as a JSON string in the report
+        if (randomStr.get()[x] == '\\')
+            randomStr.get()[x] = '_';
+    }
 
     vector<Type *> TimespecMembers(2);
     TimespecMembers[0] = IntegerType::getInt64Ty(Builder.getContext());
@@ -1945,6 +3239,15 @@ int main(int argc, char **argv) {
     PthreadAttrType =
         StructType::create(Builder.getContext(), "struct.pthread_attr");
 
+    vector<Type *> ScaleArgMembers(4);
+    ScaleArgMembers[0] = PointerType::getUnqual(
+        FunctionType::get(Builder.getVoidTy(), false));
+    ScaleArgMembers[1] = IntegerType::getInt64Ty(Builder.getContext());
+    ScaleArgMembers[2] = IntegerType::getInt64Ty(Builder.getContext());
+    ScaleArgMembers[3] = IntegerType::getInt64Ty(Builder.getContext());
+    ScaleArgType = StructType::create(Builder.getContext(), "struct.scale_arg");
+    ScaleArgType->setBody(ScaleArgMembers);
+
     vector<Type *> PProcMapMembers(7);
     PProcMapMembers[0] = PointerType::getInt8Ty(Builder.getContext());
     PProcMapMembers[1] = PointerType::getInt8Ty(Builder.getContext());
@@ -1966,6 +3269,14 @@ int main(int argc, char **argv) {
 
     Lim = Builder.getInt64(lim);
 
+    warmupRuns = ::strtoll(WarmupRuns.c_str(), 0, 10);
+    if (warmupRuns < 0)
+        warmupRuns = 0;
+
+    measuredRuns = ::strtoll(MeasuredRuns.c_str(), 0, 10);
+    if (measuredRuns < 1)
+        measuredRuns = 1;
+
     int64_t bufferSize = ::strtoll(RandomBufferSize.c_str(), 0, 10);
     if (bufferSize >= 8 && bufferSize <= 256)
         ABufferSize = Builder.getInt64(bufferSize);
@@ -1991,6 +3302,25 @@ int main(int argc, char **argv) {
     else if (sizeToAllocate % sizeof(void *))
         sizeToAllocate += (sizeToAllocate % sizeof(void *));
 
+    if (Sizes.empty()) {
+        sweepSizes.push_back(sizeToAllocate);
+    } else if (!parseSizes(Sizes, sweepSizes)) {
+        errs() << "Invalid sizes\n";
+        return false;
+    }
+
+    if (!Threads.empty() && !parseSizes(Threads, scaleThreads)) {
+        errs() << "Invalid threads\n";
+        return false;
+    }
+
+    for (auto Workers : scaleThreads) {
+        if (Workers > 256) {
+            errs() << "Invalid threads\n";
+            return false;
+        }
+    }
+
     Constant *SizeConst =
         ConstantInt::get(Builder.getInt64Ty(), sizeToAllocate);
     Constant *SizeDblConst =
@@ -2037,6 +3367,22 @@ int main(int argc, char **argv) {
                                     GlobalVariable::PrivateLinkage,
                                     SizeDblConst, "Ptrdblsize");
 
+    ScaleReady = new GlobalVariable(*Mod, Builder.getInt64Ty(), false,
+                                    GlobalVariable::PrivateLinkage, Zero,
+                                    "Scaleready");
+
+    ArrayType *PerfFdsType = ArrayType::get(Builder.getInt32Ty(), 4);
+    PerfFds = new GlobalVariable(
+        *Mod, PerfFdsType, false, GlobalVariable::PrivateLinkage,
+        ConstantArray::get(PerfFdsType, vector<Constant *>(4, MinusOne)),
+        "Perffds");
+
+    ArrayType *PerfValuesType = ArrayType::get(Builder.getInt64Ty(), 4);
+    PerfValues = new GlobalVariable(*Mod, PerfValuesType, false,
+                                    GlobalVariable::PrivateLinkage,
+                                    ConstantAggregateZero::get(PerfValuesType),
+                                    "Perfvalues");
+
     TotalUsableSize = new GlobalVariable(*Mod, Builder.getInt64Ty(), false,
                                          GlobalVariable::PrivateLinkage, Zero,
                                          "Totalusablesize");
@@ -2096,8 +3442,8 @@ int main(int argc, char **argv) {
                                          GlobalVariable::PrivateLinkage, Zero32,
                                          "Randomvalue");
 
-    LastBuffer = new GlobalVariable(*Mod, Builder.getInt8PtrTy(), false,
-                                    GlobalVariable::PrivateLinkage, ZeroPtr,
+    LastBuffer = new GlobalVariable(*Mod, Builder.getInt64Ty(), false,
+                                    GlobalVariable::PrivateLinkage, Zero,
                                     "Lastbuffer");
 
     GZero = new GlobalVariable(*Mod, Builder.getInt64Ty(), false,
@@ -2128,10 +3474,10 @@ int main(int argc, char **argv) {
 
     MAtHwcap = new GlobalVariable(*Mod, Builder.getInt32Ty(), true,
                                   GlobalVariable::PrivateLinkage,
-                                  Builder.getInt64(25), "MAtHwcap");
+                                  Builder.getInt32(25), "MAtHwcap");
     MAtHwcap2 = new GlobalVariable(*Mod, Builder.getInt32Ty(), true,
                                    GlobalVariable::PrivateLinkage,
-                                   Builder.getInt64(26), "MAtHwcap2");
+                                   Builder.getInt32(26), "MAtHwcap2");
 
     GThreadName = new GlobalVariable(*Mod, Builder.getInt8PtrTy(), false,
                                      GlobalVariable::PrivateLinkage, ZeroPtr,
@@ -2147,11 +3493,11 @@ int main(int argc, char **argv) {
 
     MemcmpRet =
         new GlobalVariable(*Mod, Builder.getInt32Ty(), false,
-                           GlobalVariable::PrivateLinkage, Zero, "Memcmpret");
+                           GlobalVariable::PrivateLinkage, Zero32, "Memcmpret");
 
     BcmpRet =
         new GlobalVariable(*Mod, Builder.getInt32Ty(), false,
-                           GlobalVariable::PrivateLinkage, Zero, "Bcmpret");
+                           GlobalVariable::PrivateLinkage, Zero32, "Bcmpret");
 
     PthreadRetCall = new GlobalVariable(*Mod, Builder.getInt32Ty(), false,
                                         GlobalVariable::PrivateLinkage,
@@ -2162,7 +3508,177 @@ int main(int argc, char **argv) {
         MinusOne, "PthreadSetnameretcall");
 
     Errno = new GlobalVariable(*Mod, Builder.getInt32Ty(), false,
-                               GlobalVariable::ExternalLinkage, Zero, "errno");
+                               GlobalVariable::ExternalLinkage, Zero32, "errno");
+
+    return true;
+}
+
+void Generator::emit(void) {
+    FILE *fp = ::fopen((outputPrefix + ".ll").c_str(), "wb");
+
+    if (fp) {
+        auto ofp = fileno(fp);
+        raw_fd_ostream F(ofp, false, false);
+        F << *Mod;
+        ::fclose(fp);
+    } else {
+        errs() << "Could not write the IR file\n";
+    }
+
+    if (Lto.empty()) {
+        compileObjectFile(targetMachine.get(), outputPrefix + ".o");
+    } else {
+        error_code EC;
+        raw_fd_ostream BC(outputPrefix + ".bc", EC, sys::fs::F_None);
+        if (EC)
+            errs() << "Could not write the bitcode file\n";
+        else
+#if LLVM_VERSION_MAJOR >= 7
+            WriteBitcodeToFile(*Mod, BC);
+#else
+            WriteBitcodeToFile(Mod, BC);
+#endif
+    }
+
+    if (DisplayMod) {
+        for (auto it = Mod->getFunctionList().begin();
+             it != Mod->getFunctionList().end(); ++it) {
+            *Out << *it << '\n';
+        }
+    }
+}
+
+// the output only depends on the generator, its command line and what
+// setup() resolved from the host, the random strings aside
+string Generator::cacheKey(int argc, char **argv) {
+    MD5 Hash;
+    Hash.update(LLVM_VERSION_STRING);
+
+    auto Exe = MemoryBuffer::getFile(sys::fs::getMainExecutable(
+        argv[0], reinterpret_cast<void *>(&parseSize)));
+    if (!Exe)
+        return "";
+    Hash.update((*Exe)->getBuffer());
+
+    for (int i = 1; i < argc; i++) {
+        Hash.update(argv[i]);
+        Hash.update(StringRef("", 1));
+    }
+    Hash.update(targetTriple);
+    Hash.update(StringRef("", 1));
+    Hash.update(targetCpu);
+    Hash.update(StringRef("", 1));
+    Hash.update(targetFeatures);
+
+    MD5::MD5Result Res;
+    Hash.final(Res);
+    SmallString<32> Key;
+    MD5::stringifyResult(Res, Key);
+
+    return "objs/cache/" + Key.str().str();
+}
+
+bool Generator::fromCache(const string &Key) {
+    string ext = Lto.empty() ? ".o" : ".bc";
+    if (!sys::fs::exists(Key + ext) || !sys::fs::exists(Key + ".ll"))
+        return false;
+
+    if (sys::fs::copy_file(Key + ext, outputPrefix + ext) ||
+        sys::fs::copy_file(Key + ".ll", outputPrefix + ".ll"))
+        return false;
+
+    if (Verbose)
+        *Out << "Reusing " << Key << "\n";
+
+    return true;
+}
+
+void Generator::toCache(const string &Key) {
+    if (sys::fs::create_directories("objs/cache"))
+        return;
+
+    // copied under a temporary name first, concurrent builds may share a key
+    string Tmp = Key + "." + to_string(::getpid());
+    if (!sys::fs::copy_file(outputPrefix + ".ll", Tmp + ".ll"))
+        sys::fs::rename(Tmp + ".ll", Key + ".ll");
+    string ext = Lto.empty() ? ".o" : ".bc";
+    if (!sys::fs::copy_file(outputPrefix + ext, Tmp + ext))
+        sys::fs::rename(Tmp + ext, Key + ext);
+}
+
+// runs the module in mpass itself, the safe_* functions and libc being
+// looked up in the process once -jit-lib is loaded
+int Generator::jit(void) {
+#if LLVM_VERSION_MAJOR >= 9
+    Triple Host(sys::getProcessTriple());
+    Triple Target(targetTriple);
+    if (Host.getArch() != Target.getArch() || Host.getOS() != Target.getOS()) {
+        errs() << "The JIT only runs the host target\n";
+        return 1;
+    }
+
+    string Error;
+    if (sys::DynamicLibrary::LoadLibraryPermanently(JitLib.c_str(), &Error)) {
+        errs() << Error << "\n";
+        return 1;
+    }
+
+    auto J = orc::LLJITBuilder().create();
+    if (!J) {
+        errs() << toString(J.takeError()) << "\n";
+        return 1;
+    }
+
+    auto Search = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        Mod->getDataLayout().getGlobalPrefix());
+    if (!Search) {
+        errs() << toString(Search.takeError()) << "\n";
+        return 1;
+    }
+#if LLVM_VERSION_MAJOR >= 10
+    (*J)->getMainJITDylib().addGenerator(std::move(*Search));
+#else
+    (*J)->getMainJITDylib().setGenerator(std::move(*Search));
+#endif
+
+    orc::ThreadSafeModule TSM(unique_ptr<Module>(Mod), std::move(Ctx));
+    Mod = nullptr;
+    if (auto Err = (*J)->addIRModule(std::move(TSM))) {
+        errs() << toString(std::move(Err)) << "\n";
+        return 1;
+    }
+
+    auto MainSym = (*J)->lookup("main");
+    if (!MainSym) {
+        errs() << toString(MainSym.takeError()) << "\n";
+        return 1;
+    }
+
+    auto MainFnc = reinterpret_cast<int (*)(void)>(
+        static_cast<uintptr_t>(MainSym->getAddress()));
+    outs().flush();
+    int ret = MainFnc();
+    ::fflush(stdout);
+
+    return ret;
+#else
+    errs() << "The JIT needs LLVM 9 or later\n";
+    return 1;
+#endif
+}
+
+// setup, generation, optimisation and output of one module, reused from
+// objs/cache when the same options built it before
+static int build(Generator &Gen, int argc, char **argv) {
+    if (!Gen.setup())
+        return Targets.empty() ? 0 : 1;
+
+    string CacheKey;
+    if (!NoCache && !Jit && !DisplayMod && !ForkMod) {
+        CacheKey = Gen.cacheKey(argc, argv);
+        if (!CacheKey.empty() && Gen.fromCache(CacheKey))
+            return 0;
+    }
 
     if (ForkMod) {
 #if defined(__FreeBSD__)
@@ -2174,36 +3690,106 @@ int main(int argc, char **argv) {
             errs() << "Error creating sub process\n";
         } else if (fpid > 0) {
             if (Verbose)
-                outs() << "As forked task\n";
-            tasks(reinterpret_cast<void *>(&Builder));
+                *Gen.Out << "As forked task\n";
+            Gen.tasks(reinterpret_cast<void *>(&Gen.RootBuilder));
         } else {
             waitpid(fpid, nullptr, 0);
         }
     } else {
-        tasks(reinterpret_cast<void *>(&Builder));
+        Gen.tasks(reinterpret_cast<void *>(&Gen.RootBuilder));
     }
 
-    FILE *fp = ::fopen("objs/operands.ll", "wb");
+    if (!Gen.optimize())
+        return 1;
 
-    if (fp) {
-        auto ofp = fileno(fp);
-        raw_fd_ostream F(ofp, false, false);
-        F << *Mod;
-        ::fclose(fp);
-    } else {
-        errs() << "Could not write the IR file\n";
+    if (Jit)
+        return Gen.jit();
+
+    Gen.emit();
+    if (!CacheKey.empty())
+        Gen.toCache(CacheKey);
+
+    return 0;
+}
+
+// at most -jobs threads take the targets in turn, each target built by its
+// own Generator, so with its own LLVMContext and module; the messages of a
+// target are printed together once it is done
+static int buildTargets(int argc, char **argv) {
+    vector<pair<string, string>> List;
+    if (!parseTargets(Targets, List)) {
+        errs() << "Invalid targets\n";
+        return 1;
     }
 
-    compileObjectFile(targetMachine.get(), "objs/operands.o");
+    long jobs = ::strtol(Jobs.c_str(), 0, 10);
+    if (jobs < 1)
+        jobs = ::sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1)
+        jobs = 1;
+
+    atomic<size_t> next(0);
+    atomic<int> failed(0);
+    mutex outLock;
+    auto worker = [&]() {
+        for (size_t i = next++; i < List.size(); i = next++) {
+            Generator Gen;
+            Gen.targetTriple = List[i].first;
+            Gen.outputPrefix = "objs/operands-" + List[i].first;
+            if (!List[i].second.empty()) {
+                Gen.targetCpu = List[i].second;
+                Gen.targetCpuSet = true;
+                Gen.outputPrefix += "-" + List[i].second;
+            }
 
-    if (DisplayMod) {
-        for (auto it = Mod->getFunctionList().begin();
-             it != Mod->getFunctionList().end(); ++it) {
-            outs() << *it << '\n';
+            string Log;
+            raw_string_ostream LogStream(Log);
+            Gen.Out = &LogStream;
+            if (build(Gen, argc, argv))
+                failed = 1;
+
+            lock_guard<mutex> Lock(outLock);
+            outs() << LogStream.str();
+            outs().flush();
         }
+    };
+
+    vector<std::thread> Workers;
+    for (long i = 0; i < jobs && static_cast<size_t>(i) < List.size(); i++)
+        Workers.emplace_back(worker);
+    for (auto &W : Workers)
+        W.join();
+
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    llvm_shutdown_obj Exit;
+    InitializeAllTargetInfos();
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmParsers();
+    InitializeAllAsmPrinters();
+
+    cl::ParseCommandLineOptions(argc, argv, "FrontEnd multipass");
+    cl::PrintOptionValues();
+
+    if ((Jit || ForkMod) && !Targets.empty()) {
+        errs() << "The JIT and -fork-mod run a single target\n";
+        return 1;
     }
 
-    delete Mod;
+    if (!Lto.empty() && ((Lto != "full" && Lto != "thin") || Jit)) {
+        errs() << "-lto is full or thin, without -jit\n";
+        return 1;
+    }
 
-    return 0;
+    if (!Targets.empty())
+        return buildTargets(argc, argv);
+
+    Generator Gen;
+    if (TargetTriple != "")
+        Gen.targetTriple = TargetTriple;
+
+    return build(Gen, argc, argv);
 }
@@ -1,82 +1,1093 @@
 #include "libs.h"
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#if !defined(USE_MMAP)
+#if defined(__linux__)
+#include <malloc.h>
+#define HAS_TCACHE 1
+#elif defined(__FreeBSD__)
+#include <malloc_np.h>
+#define HAS_TCACHE 1
+#endif
+#else
+#define HAS_TCACHE 1
+#endif
+#if defined(__x86_64__) && (defined(__linux__) || defined(__FreeBSD__))
+#define HAS_IFUNC 1
+#endif
 
 extern "C" {
 
 const int CLOBBER = 0xdead;
 const size_t HUGE_MAP_SZ = 2 * 1024 * 1024;
-#if defined(USE_MMAP)
+// small classes up to SLAB_MAX go through the thread caches, the medium
+// ones up to ARENA_MAX straight to the shared lists
+const size_t SLAB_NCLASSES = 60;
+const size_t SLAB_NSMALL = 40;
+const size_t SLAB_MAX = 32768;
+const size_t TCACHE_MAX = 64;
+const size_t TCACHE_BATCH = 32;
+const size_t MEMSET_REP_MIN = 2048;
+const size_t SEARCH_ZMM_MIN = 256;
+// scratch for safe_proc_maps_visit callers that bring no buffer
+const size_t PROC_MAPS_SCRATCH = 256 * 1024;
+#if defined(__linux__)
+// requests this large skip the per-thread pool and go to the kernel
+const size_t RNG_DIRECT_MIN = 256;
+const size_t RNG_POOL_SZ = 512;
+// pool refills between two fresh keys from getrandom
+const size_t RNG_RESEED = 4096;
+#endif
+#if defined(HAS_TCACHE)
 const int32_t canary = 0x3aff5d;
+// a cached chunk keeps its class, the canary tells it was freed already
+const int32_t canary_free = 0x5dff3a;
 const size_t szl = sizeof(size_t);
 const size_t cl = sizeof(canary);
+// canary, size class and length, keeps user pointers 16 bytes aligned
+const size_t hdrsz = 16;
+const size_t SLAB_RUN_SZ = 64 * 1024;
+#endif
+#if defined(USE_MMAP)
+const uint32_t SLAB_DIRECT = 0xffffffff;
+const size_t SLAB_ARENA_SZ = 4 * 1024 * 1024;
+const size_t ARENA_MAX = 1024 * 1024;
+// arena leftovers kept for smaller runs once a run did not fit
+const size_t ARENA_TAILS = 8;
+// idle medium chunks kept mapped per class, the others are trimmed
+const size_t SLAB_IDLE_KEEP = 2;
+// SAFE_HUGEPAGES=off|thp|hugetlb picks how arenas are backed, thp default
+// SAFE_PREFAULT_MB sizes the pool of pre-faulted arenas, 0 turns it off;
+// the pool is only filled once a process used up its first arena
+const size_t PREFAULT_DEFAULT_MB = 8;
+const int HUGEPAGES_OFF = 0;
+const int HUGEPAGES_THP = 1;
+const int HUGEPAGES_TLB = 2;
+#elif defined(HAS_TCACHE)
+// runs registered at most, 3/4 of the table so a lookup ends on a hole
+const size_t SLAB_RUNS_MAX = 32768;
+#endif
+
+struct slab_class {
+    int lock;
+    size_t cnt;
+    void *freelst;
+};
+
+struct tcache_bin {
+    void *head;
+    size_t cnt;
+};
+
+static struct slab_class slabs[SLAB_NCLASSES];
+#if defined(USE_MMAP)
+static int arena_lock = 0;
+static char *arena_cur = nullptr;
+static char *arena_end = nullptr;
+static struct arena_tail {
+    char *cur;
+    char *end;
+} arena_tails[ARENA_TAILS];
+static int pool_started = 0;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static char *pool_head = nullptr;
+static size_t pool_cnt = 0;
+static size_t pool_max = 0;
+#endif
+#if defined(HAS_TCACHE)
+// 0: not set up, 1: setting up or exited, cache bypassed, 2: ready
+static __thread int tcache_state = 0;
+static __thread struct tcache_bin tcache[SLAB_NCLASSES];
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#if !defined(USE_MMAP)
+// run address | class of every run the libc build carved chunks from
+static uintptr_t slab_runs[SLAB_RUNS_MAX];
+static size_t slab_nruns = 0;
+#endif
 #endif
 
 struct p_proc_map pmap[PROC_MAP_MAX] = {{0}};
 #if !defined(USE_MMAP)
 static void (*ofree)(void *) = nullptr;
+static int (*opmemalign)(void **, size_t, size_t) = nullptr;
+static void *(*orealloc)(void *, size_t) = nullptr;
 
 void init_libc(void) {
     if (ofree)
         return;
 
+    opmemalign = reinterpret_cast<decltype(opmemalign)>(
+        dlsym(RTLD_NEXT, "posix_memalign"));
+    orealloc =
+        reinterpret_cast<decltype(orealloc)>(dlsym(RTLD_NEXT, "realloc"));
     ofree = reinterpret_cast<decltype(ofree)>(dlsym(RTLD_NEXT, "free"));
-    if (!ofree)
+    if (!ofree || !opmemalign || !orealloc)
         errx(1, "%s\n", dlerror());
 }
 #endif
 
 void safe_bzero(void *p, size_t l) { (void)safe_memset(p, 0, l); }
 
-void *safe_memset(void *p, int c, size_t l) {
-    volatile char *ptr = reinterpret_cast<volatile char *>(p);
-    for (auto i = 0ul; i < l; i++)
-        ptr[i] = c;
+// The accumulators go through an empty asm at every step so the compiler
+// can not prove them non zero and bail out of the loops early.
+static uint64_t bcmp_tail(const unsigned char *ua, const unsigned char *ub,
+                          size_t l) {
+    uint64_t acc = 0;
+    size_t idx = 0;
+
+    for (; idx + sizeof(acc) <= l; idx += sizeof(acc)) {
+        uint64_t x, y;
+        ::memcpy(&x, ua + idx, sizeof(x));
+        ::memcpy(&y, ub + idx, sizeof(y));
+        acc |= x ^ y;
+        __asm__ __volatile__("" : "+r"(acc));
+    }
+    for (; idx < l; idx++) {
+        acc |= ua[idx] ^ ub[idx];
+        __asm__ __volatile__("" : "+r"(acc));
+    }
+
+    return acc;
+}
+
+// same result as or-ing every byte difference together
+static int bcmp_fold(uint64_t acc) {
+    acc |= acc >> 32;
+    acc |= acc >> 16;
+    acc |= acc >> 8;
+    return static_cast<int>(acc & 0xff);
+}
+
+#if !defined(__x86_64__)
+static int bcmp_word(const void *a, const void *b, size_t l) {
+    return bcmp_fold(bcmp_tail(reinterpret_cast<const unsigned char *>(a),
+                               reinterpret_cast<const unsigned char *>(b), l));
+}
+#endif
+
+#if defined(__x86_64__)
+__attribute__((target("sse2"))) static int bcmp_sse2(const void *a,
+                                                     const void *b, size_t l) {
+    auto ua = reinterpret_cast<const unsigned char *>(a);
+    auto ub = reinterpret_cast<const unsigned char *>(b);
+    __m128i acc = _mm_setzero_si128();
+    size_t idx = 0;
+    uint64_t w[2];
+
+    for (; idx + sizeof(acc) <= l; idx += sizeof(acc)) {
+        __m128i x =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(ua + idx));
+        __m128i y =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(ub + idx));
+        acc = _mm_or_si128(acc, _mm_xor_si128(x, y));
+        __asm__ __volatile__("" : "+x"(acc));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(w), acc);
+
+    return bcmp_fold(w[0] | w[1] | bcmp_tail(ua + idx, ub + idx, l - idx));
+}
+
+__attribute__((target("avx2"))) static int bcmp_avx2(const void *a,
+                                                     const void *b, size_t l) {
+    auto ua = reinterpret_cast<const unsigned char *>(a);
+    auto ub = reinterpret_cast<const unsigned char *>(b);
+    __m256i acc = _mm256_setzero_si256();
+    size_t idx = 0;
+    uint64_t w[4];
+
+    for (; idx + sizeof(acc) <= l; idx += sizeof(acc)) {
+        __m256i x =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ua + idx));
+        __m256i y =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ub + idx));
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(x, y));
+        __asm__ __volatile__("" : "+x"(acc));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(w), acc);
+
+    return bcmp_fold(w[0] | w[1] | w[2] | w[3] |
+                     bcmp_tail(ua + idx, ub + idx, l - idx));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static int
+bcmp_avx512(const void *a, const void *b, size_t l) {
+    auto ua = reinterpret_cast<const unsigned char *>(a);
+    auto ub = reinterpret_cast<const unsigned char *>(b);
+    __m512i acc = _mm512_setzero_si512();
+    size_t idx = 0;
+    uint64_t w[8];
+
+    for (; idx + sizeof(acc) <= l; idx += sizeof(acc)) {
+        __m512i x = _mm512_loadu_si512(ua + idx);
+        __m512i y = _mm512_loadu_si512(ub + idx);
+        acc = _mm512_or_si512(acc, _mm512_xor_si512(x, y));
+        __asm__ __volatile__("" : "+v"(acc));
+    }
+    _mm512_storeu_si512(w, acc);
+
+    return bcmp_fold(w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7] |
+                     bcmp_tail(ua + idx, ub + idx, l - idx));
+}
+#endif
+
+// The memory clobber inside the loops stops the compiler from turning them
+// into a memset call, which would come back here through the wrapper.
+static void *memset_word(void *p, int c, size_t l) {
+    auto up = reinterpret_cast<unsigned char *>(p);
+    uint64_t w = 0x0101010101010101ull * static_cast<unsigned char>(c);
+    size_t idx = 0;
+
+    for (; idx + sizeof(w) <= l; idx += sizeof(w)) {
+        ::memcpy(up + idx, &w, sizeof(w));
+        __asm__ __volatile__("" : : "r"(up) : "memory");
+    }
+    for (; idx < l; idx++) {
+        up[idx] = static_cast<unsigned char>(c);
+        __asm__ __volatile__("" : : "r"(up) : "memory");
+    }
 
     return p;
 }
 
-int safe_bcmp(const void *a, const void *b, size_t l) {
-    const volatile unsigned char *ua =
-        reinterpret_cast<const volatile unsigned char *>(a);
-    const volatile unsigned char *ub =
-        reinterpret_cast<const volatile unsigned char *>(b);
+#if defined(__x86_64__)
+static bool has_erms = false;
+
+static void *memset_rep(void *p, int c, size_t l) {
+    void *d = p;
+
+    __asm__ __volatile__("rep stosb"
+                         : "+D"(d), "+c"(l)
+                         : "a"(c)
+                         : "memory");
+
+    return p;
+}
+
+__attribute__((target("sse2"))) static void *memset_sse2(void *p, int c,
+                                                         size_t l) {
+    if (l < sizeof(__m128i))
+        return memset_word(p, c, l);
+    if (has_erms && l >= MEMSET_REP_MIN)
+        return memset_rep(p, c, l);
+    auto up = reinterpret_cast<unsigned char *>(p);
+    __m128i v = _mm_set1_epi8(static_cast<char>(c));
     size_t idx = 0;
-    int delta = 0;
 
-    while (idx < l) {
-        delta |= ua[idx] ^ ub[idx];
-        idx++;
+    for (; idx + 4 * sizeof(v) <= l; idx += 4 * sizeof(v)) {
+        auto vp = reinterpret_cast<__m128i *>(up + idx);
+        _mm_storeu_si128(vp, v);
+        _mm_storeu_si128(vp + 1, v);
+        _mm_storeu_si128(vp + 2, v);
+        _mm_storeu_si128(vp + 3, v);
+        __asm__ __volatile__("" : : "r"(up) : "memory");
     }
+    for (; idx + sizeof(v) <= l; idx += sizeof(v)) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(up + idx), v);
+        __asm__ __volatile__("" : : "r"(up) : "memory");
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(up + l - sizeof(v)), v);
 
-    return delta;
+    return p;
 }
 
-void *safe_memmem(const void *a, size_t al, const void *b, size_t bl) {
-    const unsigned char *ua = reinterpret_cast<const unsigned char *>(a);
-    const unsigned char *ub = reinterpret_cast<const unsigned char *>(b);
+__attribute__((target("avx2"))) static void *memset_avx2(void *p, int c,
+                                                         size_t l) {
+    // short lengths never touch the vector registers, no broadcast and no
+    // legacy SSE code mixed with the wide one
+    if (l < sizeof(__m256i))
+        return memset_word(p, c, l);
+    if (has_erms && l >= MEMSET_REP_MIN)
+        return memset_rep(p, c, l);
+    auto up = reinterpret_cast<unsigned char *>(p);
+    __m256i v = _mm256_set1_epi8(static_cast<char>(c));
+    size_t idx = 0;
 
-    if (bl == 0)
-        return const_cast<void *>(a);
-    if (al < bl)
-        return nullptr;
+    for (; idx + 4 * sizeof(v) <= l; idx += 4 * sizeof(v)) {
+        auto vp = reinterpret_cast<__m256i *>(up + idx);
+        _mm256_storeu_si256(vp, v);
+        _mm256_storeu_si256(vp + 1, v);
+        _mm256_storeu_si256(vp + 2, v);
+        _mm256_storeu_si256(vp + 3, v);
+        __asm__ __volatile__("" : : "r"(up) : "memory");
+    }
+    for (; idx + sizeof(v) <= l; idx += sizeof(v)) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(up + idx), v);
+        __asm__ __volatile__("" : : "r"(up) : "memory");
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(up + l - sizeof(v)), v);
+
+    return p;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void *
+memset_avx512(void *p, int c, size_t l) {
+    if (l < sizeof(__m512i))
+        return l < sizeof(__m256i) ? memset_word(p, c, l)
+                                   : memset_avx2(p, c, l);
+    if (has_erms && l >= MEMSET_REP_MIN)
+        return memset_rep(p, c, l);
+    auto up = reinterpret_cast<unsigned char *>(p);
+    __m512i v = _mm512_set1_epi8(static_cast<char>(c));
+    size_t idx = 0;
+
+    for (; idx + 4 * sizeof(v) <= l; idx += 4 * sizeof(v)) {
+        _mm512_storeu_si512(up + idx, v);
+        _mm512_storeu_si512(up + idx + sizeof(v), v);
+        _mm512_storeu_si512(up + idx + 2 * sizeof(v), v);
+        _mm512_storeu_si512(up + idx + 3 * sizeof(v), v);
+        __asm__ __volatile__("" : : "r"(up) : "memory");
+    }
+    for (; idx + sizeof(v) <= l; idx += sizeof(v)) {
+        _mm512_storeu_si512(up + idx, v);
+        __asm__ __volatile__("" : : "r"(up) : "memory");
+    }
+    _mm512_storeu_si512(up + l - sizeof(v), v);
+
+    return p;
+}
+#endif
+
+// Crochemore-Perrin Two-Way matching, linear in the haystack length
+// whatever the needle looks like. Adapted from musl's twoway_memmem
+// (src/string/memmem.c), under the following terms:
+//
+// Copyright © 2005-2020 Rich Felker, et al.
+//
+// Permission is hereby granted, free of charge, to any person obtaining
+// a copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+// CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// The bad character shift looks at the last two window bytes rather than
+// the last one, as glibc does, so small alphabets still skip ahead.
+static size_t search_hash2(const unsigned char *p) {
+    return (static_cast<size_t>(p[1]) - (static_cast<size_t>(p[0]) << 3)) %
+           256;
+}
+
+static const unsigned char *twoway_search(const unsigned char *h, size_t hl,
+                                          const unsigned char *n, size_t l) {
+    const unsigned char *z = h + hl;
+    // 1 + end of the last needle pair with that hash, 0 for none
+    size_t shift[256] = {0};
+    size_t i, ip, jp, k, p, ms, p0, mem, mem0;
+    // window ending on the needle last pair, distance to its previous
+    // occurrence
+    size_t shift1 = l - 1;
+    size_t last = search_hash2(n + l - 2);
+
+    for (i = 1; i < l; i++) {
+        shift[search_hash2(n + i - 1)] = i + 1;
+        if (i < l - 1 && search_hash2(n + i - 1) == last)
+            shift1 = l - 1 - i;
+    }
+
+    // maximal suffix for both orderings, the longer one is the critical
+    // factorization
+    ip = static_cast<size_t>(-1);
+    jp = 0;
+    k = p = 1;
+    while (jp + k < l) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (n[ip + k] > n[jp + k]) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+    ms = ip;
+    p0 = p;
+
+    ip = static_cast<size_t>(-1);
+    jp = 0;
+    k = p = 1;
+    while (jp + k < l) {
+        if (n[ip + k] == n[jp + k]) {
+            if (k == p) {
+                jp += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (n[ip + k] < n[jp + k]) {
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        } else {
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+    if (ip + 1 > ms + 1)
+        ms = ip;
+    else
+        p = p0;
+
+    // periodic needles remember how much of the left half already matched
+    if (safe_bcmp(n, n + p, ms + 1)) {
+        mem0 = 0;
+        p = (ms > l - ms - 1 ? ms : l - ms - 1) + 1;
+    } else {
+        mem0 = l - p;
+    }
+    mem = 0;
+
+    for (;;) {
+        if (static_cast<size_t>(z - h) < l)
+            return nullptr;
+
+        size_t sh = shift[search_hash2(h + l - 2)];
+        if (sh) {
+            k = l - sh;
+            if (k) {
+                h += k;
+                mem = 0;
+                continue;
+            }
+        } else {
+            // the pair is nowhere in the needle, its last byte may start it
+            h += l - 1;
+            mem = 0;
+            continue;
+        }
 
-    if (bl == 1)
-        return memchr(const_cast<void *>(a), *ub, bl);
+        for (k = (ms + 1 > mem ? ms + 1 : mem); k < l && n[k] == h[k]; k++)
+            ;
+        if (k < l) {
+            h += k - ms > shift1 ? k - ms : shift1;
+            mem = 0;
+            continue;
+        }
+        for (k = ms + 1; k > mem && n[k - 1] == h[k - 1]; k--)
+            ;
+        if (k <= mem)
+            return h;
+        h += p;
+        mem = mem0;
+    }
+}
 
-    const volatile unsigned char *end = ua + (al - bl);
+// length of the common prefix, verifying a candidate costs that much
+static size_t search_eq(const unsigned char *a, const unsigned char *b,
+                        size_t l) {
+    size_t i = 0;
+    while (i < l && a[i] == b[i])
+        i++;
+    return i;
+}
 
-    for (const unsigned char *cur = ua; cur <= end; ++cur) {
-        unsigned char *pcur = const_cast<unsigned char *>(cur);
-        void *vcur = reinterpret_cast<void *>(pcur);
-        if (cur[0] == ub[0] && safe_bcmp(vcur, b, bl) == 0)
-            return vcur;
+#if defined(__x86_64__)
+// The anchor is the first needle byte that differs from the last one, so
+// runs of a repeated byte such as a...ab or a...aba do not turn every
+// haystack position into a candidate.
+static size_t search_anchor(const unsigned char *n, size_t l) {
+    for (size_t j = 0; j < l - 1; j++) {
+        if (n[j] != n[l - 1])
+            return j;
     }
+    return 0;
+}
+
+// Candidates must match the needle anchor and last bytes; once verifying
+// them has compared more bytes than a linear scan would, the caller falls
+// back to Two-Way from *pos on.
+__attribute__((target("sse2"))) static const unsigned char *
+search_sse2(const unsigned char *h, size_t hl, const unsigned char *n, size_t l,
+            size_t *pos) {
+    size_t a = search_anchor(n, l);
+    const __m128i first = _mm_set1_epi8(static_cast<char>(n[a]));
+    const __m128i last = _mm_set1_epi8(static_cast<char>(n[l - 1]));
+    size_t work = 0;
+    size_t i = 0;
+
+    for (; i + l - 1 + sizeof(first) <= hl; i += sizeof(first)) {
+        __m128i f =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(h + i + a));
+        __m128i e =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(h + i + l - 1));
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(f, first), _mm_cmpeq_epi8(e, last)));
+
+        while (mask) {
+            size_t c = i + __builtin_ctz(mask);
+            size_t m = search_eq(h + c, n, l - 1);
+            if (m == l - 1)
+                return h + c;
+            work += m + 1;
+            mask &= mask - 1;
+        }
+        if (work > 2 * i + 256)
+            break;
+    }
+    *pos = i;
 
     return nullptr;
 }
 
+__attribute__((target("avx2"))) static const unsigned char *
+search_avx2(const unsigned char *h, size_t hl, const unsigned char *n, size_t l,
+            size_t *pos) {
+    size_t a = search_anchor(n, l);
+    const __m256i first = _mm256_set1_epi8(static_cast<char>(n[a]));
+    const __m256i last = _mm256_set1_epi8(static_cast<char>(n[l - 1]));
+    size_t work = 0;
+    size_t i = 0;
+
+    for (; i + l - 1 + sizeof(first) <= hl; i += sizeof(first)) {
+        __m256i f =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(h + i + a));
+        __m256i e = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(h + i + l - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(f, first), _mm256_cmpeq_epi8(e, last)));
+
+        while (mask) {
+            size_t c = i + __builtin_ctz(mask);
+            size_t m = search_eq(h + c, n, l - 1);
+            if (m == l - 1)
+                return h + c;
+            work += m + 1;
+            mask &= mask - 1;
+        }
+        if (work > 2 * i + 256)
+            break;
+    }
+    *pos = i;
+
+    return nullptr;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static const unsigned char *
+search_avx512(const unsigned char *h, size_t hl, const unsigned char *n,
+              size_t l, size_t *pos) {
+    size_t a = search_anchor(n, l);
+    const __m512i first = _mm512_set1_epi8(static_cast<char>(n[a]));
+    const __m512i last = _mm512_set1_epi8(static_cast<char>(n[l - 1]));
+    size_t work = 0;
+    size_t i = 0;
+
+    for (; i + l - 1 + sizeof(first) <= hl; i += sizeof(first)) {
+        __m512i f = _mm512_loadu_si512(h + i + a);
+        __m512i e = _mm512_loadu_si512(h + i + l - 1);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(f, first) &
+                        _mm512_cmpeq_epi8_mask(e, last);
+
+        while (mask) {
+            size_t c = i + __builtin_ctzll(mask);
+            size_t m = search_eq(h + c, n, l - 1);
+            if (m == l - 1)
+                return h + c;
+            work += m + 1;
+            mask &= mask - 1;
+        }
+        if (work > 2 * i + 256)
+            break;
+    }
+    *pos = i;
+
+    return nullptr;
+}
+#endif
+
+typedef const unsigned char *(*search_prefilter)(const unsigned char *, size_t,
+                                                 const unsigned char *, size_t,
+                                                 size_t *);
+
+static const unsigned char *search(const unsigned char *h, size_t hl,
+                                   const unsigned char *n, size_t l,
+                                   search_prefilter prefilter) {
+    size_t pos = 0;
+
+    if (l == 0)
+        return h;
+    if (hl < l)
+        return nullptr;
+    if (l == 1)
+        return reinterpret_cast<const unsigned char *>(memchr(h, *n, hl));
+    if (prefilter) {
+        const unsigned char *r = prefilter(h, hl, n, l, &pos);
+        if (r)
+            return r;
+    }
+
+    return twoway_search(h + pos, hl - pos, n, l);
+}
+
+static void *memmem_with(const void *a, size_t al, const void *b, size_t bl,
+                         search_prefilter prefilter) {
+    return const_cast<unsigned char *>(
+        search(reinterpret_cast<const unsigned char *>(a), al,
+               reinterpret_cast<const unsigned char *>(b), bl, prefilter));
+}
+
+#if !defined(__x86_64__)
+static void *memmem_word(const void *a, size_t al, const void *b, size_t bl) {
+    return memmem_with(a, al, b, bl, nullptr);
+}
+
+static char *strncpy_word(char *dst, const char *src, size_t l) {
+    int d = 0;
+    char *udst = dst;
+    const char *usrc = src;
+
+    if (!l || !dst || !src)
+        return NULL;
+
+    while (l-- > 0) {
+        if (!*usrc || !(*udst++ = *usrc++))
+            break;
+        ++d;
+    }
+
+    dst[d] = 0;
+
+    return dst;
+}
+#endif
+
+#if defined(__x86_64__)
+static void *memmem_sse2(const void *a, size_t al, const void *b, size_t bl) {
+    return memmem_with(a, al, b, bl, search_sse2);
+}
+
+static void *memmem_avx2(const void *a, size_t al, const void *b, size_t bl) {
+    return memmem_with(a, al, b, bl, search_avx2);
+}
+
+// one zmm window would leave most of a short haystack to Two-Way
+static void *memmem_avx512(const void *a, size_t al, const void *b,
+                           size_t bl) {
+    return memmem_with(a, al, b, bl,
+                       al < SEARCH_ZMM_MIN ? search_avx2 : search_avx512);
+}
+
+// The loads are aligned so they never cross into the next page, whatever
+// lies past the terminator.
+__attribute__((target("sse2"))) static size_t strnlen_sse2(const char *s,
+                                                           size_t l) {
+    const __m128i z = _mm_setzero_si128();
+    size_t off = reinterpret_cast<uintptr_t>(s) % sizeof(z);
+    auto p = reinterpret_cast<const __m128i *>(s - off);
+    unsigned int mask =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(p), z)) >> off;
+    size_t n = 0;
+
+    if (mask)
+        return static_cast<size_t>(__builtin_ctz(mask)) < l
+                   ? __builtin_ctz(mask)
+                   : l;
+    for (n = sizeof(z) - off; n < l; n += sizeof(z)) {
+        p = reinterpret_cast<const __m128i *>(s + n);
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(p), z));
+        if (mask) {
+            n += __builtin_ctz(mask);
+            break;
+        }
+    }
+
+    return n < l ? n : l;
+}
+
+__attribute__((target("avx2"))) static size_t strnlen_avx2(const char *s,
+                                                           size_t l) {
+    const __m256i z = _mm256_setzero_si256();
+    size_t off = reinterpret_cast<uintptr_t>(s) % sizeof(z);
+    auto p = reinterpret_cast<const __m256i *>(s - off);
+    unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(
+                            _mm256_cmpeq_epi8(_mm256_load_si256(p), z))) >>
+                        off;
+    size_t n = 0;
+
+    if (mask)
+        return static_cast<size_t>(__builtin_ctz(mask)) < l
+                   ? __builtin_ctz(mask)
+                   : l;
+    for (n = sizeof(z) - off; n < l; n += sizeof(z)) {
+        p = reinterpret_cast<const __m256i *>(s + n);
+        mask = static_cast<unsigned int>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256(p), z)));
+        if (mask) {
+            n += __builtin_ctz(mask);
+            break;
+        }
+    }
+
+    return n < l ? n : l;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static size_t
+strnlen_avx512(const char *s, size_t l) {
+    const __m512i z = _mm512_setzero_si512();
+    size_t off = reinterpret_cast<uintptr_t>(s) % sizeof(z);
+    uint64_t mask =
+        _mm512_cmpeq_epi8_mask(_mm512_load_si512(s - off), z) >> off;
+    size_t n = 0;
+
+    if (mask)
+        return static_cast<size_t>(__builtin_ctzll(mask)) < l
+                   ? __builtin_ctzll(mask)
+                   : l;
+    for (n = sizeof(z) - off; n < l; n += sizeof(z)) {
+        mask = _mm512_cmpeq_epi8_mask(_mm512_load_si512(s + n), z);
+        if (mask) {
+            n += __builtin_ctzll(mask);
+            break;
+        }
+    }
+
+    return n < l ? n : l;
+}
+
+// same result as strncpy_word, the terminator always written at dst[n]
+static char *strncpy_with(char *dst, const char *src, size_t l,
+                          size_t (*len)(const char *, size_t)) {
+    if (!l || !dst || !src)
+        return NULL;
+
+    size_t n = len(src, l);
+    ::memcpy(dst, src, n);
+    dst[n] = 0;
+
+    return dst;
+}
+
+static char *strncpy_sse2(char *dst, const char *src, size_t l) {
+    return strncpy_with(dst, src, l, strnlen_sse2);
+}
+
+static char *strncpy_avx2(char *dst, const char *src, size_t l) {
+    return strncpy_with(dst, src, l, strnlen_avx2);
+}
+
+static char *strncpy_avx512(char *dst, const char *src, size_t l) {
+    return strncpy_with(dst, src, l, strnlen_avx512);
+}
+
+enum cpu_level { CPU_SSE2, CPU_AVX2, CPU_AVX512 };
+
+// resolvers run before the constructors, the cpu model included
+static enum cpu_level cpu_level(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return CPU_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return CPU_AVX2;
+    return CPU_SSE2;
+}
+#endif
+typedef void *(*memset_fn)(void *, int, size_t);
+typedef int (*bcmp_fn)(const void *, const void *, size_t);
+typedef void *(*memmem_fn)(const void *, size_t, const void *, size_t);
+typedef char *(*strncpy_fn)(char *, const char *, size_t);
+
+// SSE2 is the x86_64 baseline, the SSE4.2 string instructions do not beat
+// it on these kernels
+static memset_fn resolve_memset(void) {
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        has_erms = (ebx >> 9) & 1;
+    switch (cpu_level()) {
+    case CPU_AVX512:
+        return memset_avx512;
+    case CPU_AVX2:
+        return memset_avx2;
+    default:
+        return memset_sse2;
+    }
+#else
+    return memset_word;
+#endif
+}
+
+static bcmp_fn resolve_bcmp(void) {
+#if defined(__x86_64__)
+    switch (cpu_level()) {
+    case CPU_AVX512:
+        return bcmp_avx512;
+    case CPU_AVX2:
+        return bcmp_avx2;
+    default:
+        return bcmp_sse2;
+    }
+#else
+    return bcmp_word;
+#endif
+}
+
+static memmem_fn resolve_memmem(void) {
+#if defined(__x86_64__)
+    switch (cpu_level()) {
+    case CPU_AVX512:
+        return memmem_avx512;
+    case CPU_AVX2:
+        return memmem_avx2;
+    default:
+        return memmem_sse2;
+    }
+#else
+    return memmem_word;
+#endif
+}
+
+static strncpy_fn resolve_strncpy(void) {
+#if defined(__x86_64__)
+    switch (cpu_level()) {
+    case CPU_AVX512:
+        return strncpy_avx512;
+    case CPU_AVX2:
+        return strncpy_avx2;
+    default:
+        return strncpy_sse2;
+    }
+#else
+    return strncpy_word;
+#endif
+}
+
+#if defined(HAS_IFUNC)
+// bound once by the dynamic linker, no indirect call left at run time
+void *safe_memset(void *, int, size_t) __attribute__((ifunc("resolve_memset")));
+int safe_bcmp(const void *, const void *, size_t)
+    __attribute__((ifunc("resolve_bcmp")));
+void *safe_memmem(const void *, size_t, const void *, size_t)
+    __attribute__((ifunc("resolve_memmem")));
+char *safe_strncpy(char *, const char *, size_t)
+    __attribute__((ifunc("resolve_strncpy")));
+#else
+// safe defaults until init_impls has run
+#if defined(__x86_64__)
+static memset_fn memset_impl = memset_sse2;
+static bcmp_fn bcmp_impl = bcmp_sse2;
+static memmem_fn memmem_impl = memmem_sse2;
+static strncpy_fn strncpy_impl = strncpy_sse2;
+#else
+static memset_fn memset_impl = memset_word;
+static bcmp_fn bcmp_impl = bcmp_word;
+static memmem_fn memmem_impl = memmem_word;
+static strncpy_fn strncpy_impl = strncpy_word;
+#endif
+
+__attribute__((constructor)) static void init_impls(void) {
+    memset_impl = resolve_memset();
+    bcmp_impl = resolve_bcmp();
+    memmem_impl = resolve_memmem();
+    strncpy_impl = resolve_strncpy();
+}
+
+void *safe_memset(void *p, int c, size_t l) { return memset_impl(p, c, l); }
+
+int safe_bcmp(const void *a, const void *b, size_t l) {
+    return bcmp_impl(a, b, l);
+}
+
+void *safe_memmem(const void *a, size_t al, const void *b, size_t bl) {
+    return memmem_impl(a, al, b, bl);
+}
+
+char *safe_strncpy(char *dst, const char *src, size_t l) {
+    return strncpy_impl(dst, src, l);
+}
+#endif
+
+#if defined(__linux__)
+// ChaCha20 with fast key erasure: every refill rekeys from its own first
+// block, so the output already handed out can not be recomputed later
+#define RNG_ROUNDS()                                                           \
+    do {                                                                       \
+        for (int r = 0; r < 10; r++) {                                         \
+            RNG_QR(0, 4, 8, 12);                                               \
+            RNG_QR(1, 5, 9, 13);                                               \
+            RNG_QR(2, 6, 10, 14);                                              \
+            RNG_QR(3, 7, 11, 15);                                              \
+            RNG_QR(0, 5, 10, 15);                                              \
+            RNG_QR(1, 6, 11, 12);                                              \
+            RNG_QR(2, 7, 8, 13);                                               \
+            RNG_QR(3, 4, 9, 14);                                               \
+        }                                                                      \
+    } while (0)
+#define RNG_QR(a, b, c, d)                                                     \
+    do {                                                                       \
+        x[a] = RNG_ADD(x[a], x[b]);                                            \
+        x[d] = RNG_ROTL(RNG_XOR(x[d], x[a]), 16);                              \
+        x[c] = RNG_ADD(x[c], x[d]);                                            \
+        x[b] = RNG_ROTL(RNG_XOR(x[b], x[c]), 12);                              \
+        x[a] = RNG_ADD(x[a], x[b]);                                            \
+        x[d] = RNG_ROTL(RNG_XOR(x[d], x[a]), 8);                               \
+        x[c] = RNG_ADD(x[c], x[d]);                                            \
+        x[b] = RNG_ROTL(RNG_XOR(x[b], x[c]), 7);                               \
+    } while (0)
+
+static void rng_state(uint32_t in[16], const uint32_t key[8], uint64_t ctr) {
+    in[0] = 0x61707865;
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    ::memcpy(in + 4, key, 32);
+    in[12] = static_cast<uint32_t>(ctr);
+    in[13] = static_cast<uint32_t>(ctr >> 32);
+    in[14] = 0;
+    in[15] = 0;
+}
+
+#if !defined(__x86_64__)
+#define RNG_ADD(a, b) ((a) + (b))
+#define RNG_XOR(a, b) ((a) ^ (b))
+#define RNG_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+static void rng_block(const uint32_t key[8], uint64_t ctr,
+                      unsigned char *out) {
+    uint32_t in[16], x[16];
+
+    rng_state(in, key, ctr);
+    ::memcpy(x, in, sizeof(x));
+    RNG_ROUNDS();
+    for (int i = 0; i < 16; i++)
+        x[i] += in[i];
+    ::memcpy(out, x, sizeof(x));
+}
+#undef RNG_ROTL
+#undef RNG_XOR
+#undef RNG_ADD
+#else
+// four consecutive blocks, one per 32 bit lane
+#define RNG_ADD _mm_add_epi32
+#define RNG_XOR _mm_xor_si128
+#define RNG_ROTL(v, n)                                                         \
+    _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+static void rng_block4(const uint32_t key[8], uint64_t ctr,
+                       unsigned char *out) {
+    uint32_t in[16], lanes[16][4];
+    __m128i x[16];
+
+    rng_state(in, key, ctr);
+    for (int i = 0; i < 16; i++)
+        x[i] = _mm_set1_epi32(static_cast<int>(in[i]));
+    for (int j = 0; j < 4; j++) {
+        lanes[12][j] = static_cast<uint32_t>(ctr + j);
+        lanes[13][j] = static_cast<uint32_t>((ctr + j) >> 32);
+    }
+    x[12] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lanes[12]));
+    x[13] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lanes[13]));
+    __m128i c12 = x[12], c13 = x[13];
+    RNG_ROUNDS();
+    for (int i = 0; i < 16; i++) {
+        __m128i v = i == 12   ? c12
+                    : i == 13 ? c13
+                              : _mm_set1_epi32(static_cast<int>(in[i]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes[i]),
+                         _mm_add_epi32(x[i], v));
+    }
+    for (int j = 0; j < 4; j++)
+        for (int i = 0; i < 16; i++)
+            ::memcpy(out + j * 64 + i * 4, &lanes[i][j], 4);
+}
+#undef RNG_ROTL
+#undef RNG_XOR
+#undef RNG_ADD
+#endif
+#undef RNG_QR
+#undef RNG_ROUNDS
+
+static unsigned long rng_gen = 1;
+static pthread_once_t rng_once = PTHREAD_ONCE_INIT;
+static __thread struct rng_pool {
+    uint32_t key[8];
+    unsigned char buf[RNG_POOL_SZ];
+    size_t pos;
+    size_t refills;
+    unsigned long gen;
+} rng;
+
+static void rng_fork_child(void) {
+    __atomic_add_fetch(&rng_gen, 1, __ATOMIC_RELAXED);
+}
+
+static void rng_init_fork(void) {
+    pthread_atfork(nullptr, nullptr, rng_fork_child);
+}
+
+static int rng_refill(void) {
+    unsigned long gen = __atomic_load_n(&rng_gen, __ATOMIC_RELAXED);
+
+    // the child of a fork must not replay the parent's stream
+    if (rng.gen != gen || rng.refills >= RNG_RESEED) {
+        pthread_once(&rng_once, rng_init_fork);
+        if (getrandom(rng.key, sizeof(rng.key), 0) !=
+            static_cast<ssize_t>(sizeof(rng.key)))
+            return -1;
+        rng.gen = gen;
+        rng.refills = 0;
+    }
+#if defined(__x86_64__)
+    for (size_t i = 0; i < RNG_POOL_SZ / 64; i += 4)
+        rng_block4(rng.key, i, rng.buf + i * 64);
+#else
+    for (size_t i = 0; i < RNG_POOL_SZ / 64; i++)
+        rng_block(rng.key, i, rng.buf + i * 64);
+#endif
+    ::memcpy(rng.key, rng.buf, sizeof(rng.key));
+    safe_bzero(rng.buf, sizeof(rng.key));
+    rng.pos = sizeof(rng.key);
+    rng.refills++;
+    return 0;
+}
+
+static int rng_read(unsigned char *out, size_t len) {
+    while (len > 0) {
+        if (rng.pos == RNG_POOL_SZ ||
+            rng.gen != __atomic_load_n(&rng_gen, __ATOMIC_RELAXED)) {
+            if (rng_refill() == -1)
+                return -1;
+        }
+        size_t n = RNG_POOL_SZ - rng.pos;
+        if (n > len)
+            n = len;
+        ::memcpy(out, rng.buf + rng.pos, n);
+        // served bytes do not stay around in the pool
+        safe_bzero(rng.buf + rng.pos, n);
+        rng.pos += n;
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+#endif
+
 int safe_getrandom(void *buf, size_t len) {
     safe_bzero(buf, len);
 #if defined(__linux__)
+    if (len < RNG_DIRECT_MIN)
+        return rng_read(reinterpret_cast<unsigned char *>(buf), len);
     ssize_t written = getrandom(buf, len, 0);
     (void)written;
     assert(written == static_cast<ssize_t>(len));
@@ -87,110 +1098,251 @@ int safe_getrandom(void *buf, size_t len) {
 #endif
 }
 
-int safe_proc_maps(pid_t pid) {
+#if defined(__linux__)
+static const char *maps_hex(const char *p, const char *e, uintptr_t *v) {
+    uintptr_t r = 0;
+    for (; p < e; p++) {
+        unsigned c = static_cast<unsigned char>(*p);
+        if (c - '0' < 10)
+            r = (r << 4) | (c - '0');
+        else if ((c | 32) - 'a' < 6)
+            r = (r << 4) | ((c | 32) - 'a' + 10);
+        else
+            break;
+    }
+    *v = r;
+    return p;
+}
+
+// "start-end perms offset dev inode path", only the leading fields matter
+static int maps_line(const char *p, const char *e, struct p_proc_map *m) {
+    uintptr_t s, en;
+
+    p = maps_hex(p, e, &s);
+    if (p == e || *p++ != '-')
+        return -1;
+    p = maps_hex(p, e, &en);
+    if (e - p < 5 || *p++ != ' ')
+        return -1;
+    ::memset(m, 0, sizeof(*m));
+    m->s = s;
+    m->e = en;
+    m->sz = en - s;
+    m->f = p[0] | p[1] | p[2];
+    ::memcpy(m->fstr, p, 3);
+    m->fstr[3] = 0;
+    return 0;
+}
+
+// "Key:   value kB"; hgmp is only set for pages huge pages really back,
+// THP or PMD mapped ones and hugetlb mappings
+static void maps_attr(const char *p, const char *e, struct p_proc_map *m) {
+    static const char *const keys[] = {"AnonHugePages:", "ShmemPmdMapped:",
+                                       "FilePmdMapped:", "KernelPageSize:"};
+    size_t k, v = 0;
+
+    for (k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        size_t kl = strlen(keys[k]);
+        if (static_cast<size_t>(e - p) > kl && !::memcmp(p, keys[k], kl)) {
+            p += kl;
+            break;
+        }
+    }
+    if (k == sizeof(keys) / sizeof(keys[0]))
+        return;
+    while (p < e && *p == ' ')
+        p++;
+    for (; p < e && static_cast<unsigned>(*p - '0') < 10; p++)
+        v = v * 10 + (*p - '0');
+    if (k == 3 ? v >= (HUGE_MAP_SZ >> 10) : v > 0)
+        m->hgmp = 1;
+}
+
+// smaps gives the maps line of a mapping then its "Key: value" lines, the
+// mapping goes to the callback once the next one starts; maps has only
+// the former
+struct maps_walk {
+    struct p_proc_map m;
+    bool have;
+    safe_proc_maps_cb cb;
+    void *arg;
+};
+
+static int maps_flush(struct maps_walk *w) {
+    if (!w->have)
+        return 0;
+    w->have = false;
+    return w->cb(&w->m, w->arg);
+}
+
+static int maps_visit_line(const char *p, const char *e,
+                           struct maps_walk *w) {
+    if (p < e && *p >= 'A' && *p <= 'Z') {
+        if (w->have)
+            maps_attr(p, e, &w->m);
+        return 0;
+    }
+    int stop = maps_flush(w);
+    if (!stop && maps_line(p, e, &w->m) == 0)
+        w->have = true;
+    return stop;
+}
+#endif
+
+// smaps costs a page table walk per mapping, it is only read when the
+// caller asks for the huge page residency
+static int proc_maps_walk(pid_t pid, safe_proc_maps_cb cb, void *arg,
+                          char *buf, size_t buflen, bool hp) {
     int ret = -1;
     int saved_err = errno;
-    size_t index = 0;
+    if (!cb || (buf && buflen < PROC_MAPS_BUF_MIN)) {
+        errno = EINVAL;
+        return -1;
+    }
     errno = 0;
     if (pid == -1)
         pid = getpid();
 #if defined(__linux__)
-    char path[256];
-    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
-
-    FILE *fp = fopen(path, "r");
-    if (fp) {
-        char buf[256];
-        while ((fgets(buf, sizeof(buf), fp))) {
-            uintptr_t s;
-            uintptr_t e;
-            char flag[4];
-            sscanf(buf, "%12lx-%12lx %c%c%c%c", &s, &e, &flag[0], &flag[1],
-                   &flag[2], &flag[3]);
-
-            if (index < PROC_MAP_MAX) {
-                int64_t f = 0;
-                f |= static_cast<int>(flag[0]);
-                f |= static_cast<int>(flag[1]);
-                f |= static_cast<int>(flag[2]);
-                size_t tsz = (e - s);
-                memcpy(&pmap[index].s, &s, sizeof(s));
-                memcpy(&pmap[index].e, &e, sizeof(e));
-                memcpy(&pmap[index].f, &f, sizeof(f));
-                memcpy(&pmap[index].sz, &tsz, sizeof(tsz));
-                pmap[index].hgmp = (tsz >= HUGE_MAP_SZ);
-                memcpy(pmap[index].fstr, flag, 3);
-                pmap[index].fstr[3] = 0;
-                index++;
-            } else {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, hp ? "smaps" : "maps");
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    char *scratch = nullptr;
+    if (!buf) {
+        void *sb = mmap(nullptr, PROC_MAPS_SCRATCH, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (sb == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        scratch = buf = reinterpret_cast<char *>(sb);
+        buflen = PROC_MAPS_SCRATCH;
+    }
+
+    // the kernel fills the whole buffer with complete lines, only a
+    // partial one is carried over to the next read
+    size_t have = 0;
+    bool skip = false;
+    int stop = 0;
+    struct maps_walk w = {};
+    w.cb = cb;
+    w.arg = arg;
+    ret = 0;
+    while (!stop) {
+        ssize_t r = read(fd, buf + have, buflen - have);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1) {
+            ret = -1;
+            break;
+        }
+        if (r == 0) {
+            if (have && !skip)
+                stop = maps_visit_line(buf, buf + have, &w);
+            if (!stop)
+                stop = maps_flush(&w);
+            break;
+        }
+        have += r;
+        char *s = buf, *e = buf + have;
+        while (!stop && s < e) {
+            auto nl = reinterpret_cast<char *>(::memchr(s, '\n', e - s));
+            if (!nl)
                 break;
-            }
+            if (!skip)
+                stop = maps_visit_line(s, nl, &w);
+            skip = false;
+            s = nl + 1;
+        }
+        have = e - s;
+        if (have == buflen) {
+            // a path longer than the buffer, its fields are all in front
+            if (!skip)
+                stop = maps_visit_line(buf, e, &w);
+            skip = true;
+            have = 0;
+        } else if (have && s != buf) {
+            ::memmove(buf, s, have);
         }
-        ret = 0;
-        fclose(fp);
     }
+    close(fd);
+    if (scratch)
+        munmap(scratch, PROC_MAPS_SCRATCH);
 #elif defined(__FreeBSD__)
+    // the superpage flag comes with every entry, no extra cost to skip
+    (void)hp;
     int mib[] = {CTL_KERN, KERN_PROC, KERN_PROC_VMMAP, pid};
     size_t miblen = sizeof(mib) / sizeof(mib[0]);
-    size_t len;
+    size_t len, mlen = 0;
     char *b, *s, *e;
 
     if (sysctl(mib, miblen, nullptr, &len, nullptr, 0) == -1)
         return -1;
     len = len * 4 / 3;
-    b = reinterpret_cast<char *>(mmap(nullptr, len, PROT_READ | PROT_WRITE,
-                                      MAP_SHARED | MAP_ANON, -1, 0));
-    if (b != (void *)-1) {
-        if (sysctl(mib, miblen, b, &len, nullptr, 0) == -1) {
-            munmap(b, len);
+    b = buf;
+    if (!buf || buflen < len) {
+        mlen = len;
+        b = reinterpret_cast<char *>(mmap(nullptr, mlen,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANON, -1, 0));
+        if (b == MAP_FAILED)
             return -1;
-        }
-
-        s = b;
-        e = s + len;
+    }
+    if (sysctl(mib, miblen, b, &len, nullptr, 0) == -1) {
+        if (mlen)
+            munmap(b, mlen);
+        return -1;
+    }
 
-        while (s < e) {
-            struct kinfo_vmentry *e = (struct kinfo_vmentry *)s;
-            size_t sz = e->kve_structsize;
+    s = b;
+    e = s + len;
 
-            if (sz == 0)
-                break;
+    while (s < e) {
+        struct kinfo_vmentry *e = (struct kinfo_vmentry *)s;
+        struct p_proc_map m;
+        size_t sz = e->kve_structsize;
 
-            int64_t f = 0;
-            if (e->kve_protection & KVME_PROT_READ) {
-                f |= KVME_PROT_READ;
-                pmap[index].fstr[0] = 'r';
-            } else {
-                pmap[index].fstr[0] = '-';
-            }
-            if (e->kve_protection & KVME_PROT_WRITE) {
-                f |= KVME_PROT_WRITE;
-                pmap[index].fstr[1] = 'w';
-            } else {
-                pmap[index].fstr[1] = '-';
-            }
-            if (e->kve_protection & KVME_PROT_EXEC) {
-                f |= KVME_PROT_EXEC;
-                pmap[index].fstr[2] = 'x';
-            } else {
-                pmap[index].fstr[2] = '-';
-            }
-            pmap[index].fstr[3] = 0;
-            size_t tsz = (e->kve_end - e->kve_start);
-            memcpy(&pmap[index].s, &e->kve_start, sizeof(pmap[index].s));
-            memcpy(&pmap[index].e, &e->kve_end, sizeof(pmap[index].e));
-            memcpy(&pmap[index].f, &f, sizeof(pmap[index].f));
-            memcpy(&pmap[index].sz, &tsz, sizeof(pmap[index].sz));
-            pmap[index].hgmp = (tsz >= HUGE_MAP_SZ);
-            index++;
+        if (sz == 0)
+            break;
 
-            s += sz;
+        ::memset(&m, 0, sizeof(m));
+        if (e->kve_protection & KVME_PROT_READ) {
+            m.f |= KVME_PROT_READ;
+            m.fstr[0] = 'r';
+        } else {
+            m.fstr[0] = '-';
+        }
+        if (e->kve_protection & KVME_PROT_WRITE) {
+            m.f |= KVME_PROT_WRITE;
+            m.fstr[1] = 'w';
+        } else {
+            m.fstr[1] = '-';
+        }
+        if (e->kve_protection & KVME_PROT_EXEC) {
+            m.f |= KVME_PROT_EXEC;
+            m.fstr[2] = 'x';
+        } else {
+            m.fstr[2] = '-';
         }
+        m.s = e->kve_start;
+        m.e = e->kve_end;
+        m.sz = m.e - m.s;
+        m.hgmp = (e->kve_flags & KVME_FLAG_SUPER) != 0;
+        if (cb(&m, arg))
+            break;
 
-        ret = 0;
-        munmap(b, len);
+        s += sz;
     }
+
+    ret = 0;
+    if (mlen)
+        munmap(b, mlen);
 #elif defined(__APPLE__)
+    (void)buf;
+    (void)buflen;
+    (void)hp;
     struct vm_region_submap_info_64 map;
     mach_msg_type_number_t cnt = VM_REGION_SUBMAP_INFO_COUNT_64;
     vm_address_t addr = 0;
@@ -205,34 +1357,31 @@ int safe_proc_maps(pid_t pid) {
         if (map.is_submap) {
             depth++;
         } else {
-            uintptr_t a = static_cast<uintptr_t>(addr);
-            uintptr_t b = a + size;
-            int64_t f = 0;
+            struct p_proc_map m;
+            ::memset(&m, 0, sizeof(m));
             if (map.protection & VM_PROT_READ) {
-                f |= VM_PROT_READ;
-                pmap[index].fstr[0] = 'r';
+                m.f |= VM_PROT_READ;
+                m.fstr[0] = 'r';
             } else {
-                pmap[index].fstr[0] = '-';
+                m.fstr[0] = '-';
             }
             if (map.protection & VM_PROT_WRITE) {
-                f |= VM_PROT_WRITE;
-                pmap[index].fstr[1] = 'w';
+                m.f |= VM_PROT_WRITE;
+                m.fstr[1] = 'w';
             } else {
-                pmap[index].fstr[1] = '-';
+                m.fstr[1] = '-';
             }
             if (map.protection & VM_PROT_EXECUTE) {
-                f |= VM_PROT_EXECUTE;
-                pmap[index].fstr[2] = 'x';
+                m.f |= VM_PROT_EXECUTE;
+                m.fstr[2] = 'x';
             } else {
-                pmap[index].fstr[2] = '-';
+                m.fstr[2] = '-';
             }
-            pmap[index].fstr[3] = 0;
-            memcpy(&pmap[index].s, &a, sizeof(pmap[index].s));
-            memcpy(&pmap[index].e, &b, sizeof(pmap[index].e));
-            memcpy(&pmap[index].f, &f, sizeof(pmap[index].f));
-            memcpy(&pmap[index].sz, &size, sizeof(pmap[index].sz));
-            pmap[index].hgmp = 0;
-            index++;
+            m.s = static_cast<uintptr_t>(addr);
+            m.e = m.s + size;
+            m.sz = size;
+            if (cb(&m, arg))
+                break;
 
             addr += size;
             size = 0;
@@ -241,33 +1390,619 @@ int safe_proc_maps(pid_t pid) {
 
     ret = 0;
 #else
-    (void)index;
+    (void)pid;
+    (void)arg;
+    (void)buf;
+    (void)buflen;
+    (void)hp;
     errno = ENOSYS;
     return 0;
 #endif
-    errno = saved_err;
+    if (ret == 0)
+        errno = saved_err;
+    return ret;
+}
+
+int safe_proc_maps_visit(pid_t pid, safe_proc_maps_cb cb, void *arg,
+                         char *buf, size_t buflen) {
+    return proc_maps_walk(pid, cb, arg, buf, buflen, false);
+}
+
+int safe_proc_smaps_visit(pid_t pid, safe_proc_maps_cb cb, void *arg,
+                          char *buf, size_t buflen) {
+    return proc_maps_walk(pid, cb, arg, buf, buflen, true);
+}
+
+static int pmap_store(const struct p_proc_map *m, void *arg) {
+    size_t *index = reinterpret_cast<size_t *>(arg);
+    pmap[*index] = *m;
+    return ++*index == PROC_MAP_MAX;
+}
+
+int safe_proc_maps(pid_t pid) {
+    size_t index = 0;
+    int ret = safe_proc_maps_visit(pid, pmap_store, &index, nullptr, 0);
+
+    // leftovers of a longer previous listing would read as live entries
+    if (index < PROC_MAP_MAX)
+        ::memset(&pmap[index], 0, sizeof(pmap[index]));
     return ret;
 }
 
+static void slab_lock(int *l) {
+    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(l, __ATOMIC_RELAXED))
+            sched_yield();
+    }
+}
+
+static void slab_unlock(int *l) { __atomic_store_n(l, 0, __ATOMIC_RELEASE); }
+
+// 16 bytes steps up to 128, then 4 classes per power of two up to ARENA_MAX
+static size_t slab_class_of(size_t sz) {
+    if (sz <= 128)
+        return (sz + 15) / 16 - 1;
+    size_t s = sz - 1;
+    size_t b = 63 - __builtin_clzl(s);
+    return 8 + (b - 7) * 4 + ((s >> (b - 2)) & 3);
+}
+
+static size_t slab_class_sz(size_t idx) {
+    if (idx < 8)
+        return (idx + 1) * 16;
+    size_t j = idx - 8;
+    return (5 + j % 4) << (5 + j / 4);
+}
+
 #if defined(USE_MMAP)
-static size_t page_sz(void) { return sysconf(_SC_PAGESIZE); }
-static size_t alloc_sz(size_t l) {
+static size_t page_sz(void) {
     static size_t pgsz = 0ul;
     if (pgsz == 0)
-        pgsz = page_sz();
+        pgsz = sysconf(_SC_PAGESIZE);
+    return pgsz;
+}
+static size_t alloc_sz(size_t l) {
+    size_t pgsz = page_sz();
     return ((l) + (pgsz - 1)) / pgsz;
 }
+
+static int huge_mode(void) {
+    static int mode = -1;
+    int m = __atomic_load_n(&mode, __ATOMIC_RELAXED);
+    if (m == -1) {
+        const char *e = getenv("SAFE_HUGEPAGES");
+        m = HUGEPAGES_THP;
+        if (e && !strcmp(e, "off"))
+            m = HUGEPAGES_OFF;
+        else if (e && !strcmp(e, "hugetlb"))
+            m = HUGEPAGES_TLB;
+        __atomic_store_n(&mode, m, __ATOMIC_RELAXED);
+    }
+    return m;
+}
+
+// arenas start on a 2 MiB boundary so whole hugepages can back them
+static char *arena_map(bool populate) {
+    int mode = huge_mode();
+    int pflags = 0;
+#if defined(__linux__)
+    if (populate)
+        pflags = MAP_POPULATE;
+    if (mode == HUGEPAGES_TLB) {
+        void *a = mmap(nullptr, SLAB_ARENA_SZ, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANON | MAP_HUGETLB | pflags, -1, 0);
+        if (a != MAP_FAILED)
+            return reinterpret_cast<char *>(a);
+        // no reserved hugepages left, settle for THP
+        mode = HUGEPAGES_THP;
+    }
+#endif
+    size_t pad = mode == HUGEPAGES_OFF ? 0 : HUGE_MAP_SZ;
+    int mflags = MAP_PRIVATE | MAP_ANON;
+#if defined(__FreeBSD__)
+    if (pad)
+        mflags |= MAP_ALIGNED_SUPER;
+    pad = 0;
+#endif
+    // THP only gets used when populating after the hint
+    if (mode != HUGEPAGES_THP)
+        mflags |= pflags;
+    void *m = mmap(nullptr, SLAB_ARENA_SZ + pad, PROT_READ | PROT_WRITE,
+                   mflags, -1, 0);
+    if (m == MAP_FAILED)
+        return nullptr;
+    auto a = reinterpret_cast<char *>(m);
+    if (pad) {
+        auto al = reinterpret_cast<char *>(
+            (reinterpret_cast<uintptr_t>(a) + HUGE_MAP_SZ - 1) &
+            ~(HUGE_MAP_SZ - 1));
+        if (al > a)
+            munmap(a, al - a);
+        munmap(al + SLAB_ARENA_SZ, a + pad - al);
+        a = al;
+    }
+#if defined(__linux__)
+    if (mode == HUGEPAGES_THP)
+        madvise(a, SLAB_ARENA_SZ, MADV_HUGEPAGE);
+#if defined(MADV_POPULATE_WRITE)
+    if (populate && mode == HUGEPAGES_THP)
+        madvise(a, SLAB_ARENA_SZ, MADV_POPULATE_WRITE);
+#endif
+#else
+    if (populate)
+        madvise(a, SLAB_ARENA_SZ, MADV_WILLNEED);
 #endif
+    return a;
+}
 
-int safe_alloc(void **ptr, size_t a, size_t l) {
+// the refill thread keeps up to pool_max arenas faulted and clobbered
+// ahead of time, they are chained through their first word
+static void *pool_refill(void *) {
+    pthread_mutex_lock(&pool_mtx);
+    while (true) {
+        while (pool_cnt >= pool_max)
+            pthread_cond_wait(&pool_cond, &pool_mtx);
+        pthread_mutex_unlock(&pool_mtx);
+        char *r = arena_map(true);
+        if (r)
+            safe_memset(r, CLOBBER, SLAB_ARENA_SZ);
+        pthread_mutex_lock(&pool_mtx);
+        if (!r) {
+            // out of memory, try again once somebody takes from the pool
+            pthread_cond_wait(&pool_cond, &pool_mtx);
+            continue;
+        }
+        ::memcpy(r, &pool_head, sizeof(pool_head));
+        pool_head = r;
+        pool_cnt++;
+    }
+    return nullptr;
+}
+
+static char *pool_take(void) {
+    char *r;
+
+    if (!__atomic_load_n(&pool_max, __ATOMIC_RELAXED))
+        return nullptr;
+    pthread_mutex_lock(&pool_mtx);
+    r = pool_head;
+    if (r) {
+        ::memcpy(&pool_head, r, sizeof(pool_head));
+        pool_cnt--;
+    }
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mtx);
+    if (r)
+        safe_memset(r, CLOBBER, sizeof(pool_head));
+    return r;
+}
+
+// the refill thread does not survive a fork, the child gives the pool
+// back and maps its arenas on demand
+static void pool_fork_child(void) {
+    while (pool_head) {
+        char *r = pool_head;
+        ::memcpy(&pool_head, r, sizeof(pool_head));
+        munmap(r, SLAB_ARENA_SZ);
+    }
+    pool_cnt = 0;
+    pool_max = 0;
+    pool_cond = PTHREAD_COND_INITIALIZER;
+}
+
+// the smallest kept leftover the run fits in
+static struct arena_tail *arena_tail_fit(size_t sz) {
+    struct arena_tail *best = nullptr;
+    for (auto &t : arena_tails) {
+        size_t left = t.end - t.cur;
+        if (left >= sz && (!best || left < static_cast<size_t>(
+                                               best->end - best->cur)))
+            best = &t;
+    }
+    return best;
+}
+
+// the current arena leftover replaces the smallest kept one
+static void arena_tail_keep(void) {
+    struct arena_tail *min = &arena_tails[0];
+    for (auto &t : arena_tails) {
+        if (t.end - t.cur < min->end - min->cur)
+            min = &t;
+    }
+    if (arena_end - arena_cur > min->end - min->cur) {
+        min->cur = arena_cur;
+        min->end = arena_end;
+    }
+}
+
+// *more is set once a whole arena went by
+static char *arena_carve(size_t sz, bool *more) {
+    char *p = nullptr;
+    slab_lock(&arena_lock);
+    if (!arena_cur || arena_cur + sz > arena_end) {
+        struct arena_tail *t = arena_tail_fit(sz);
+        if (t) {
+            p = t->cur;
+            t->cur += sz;
+            slab_unlock(&arena_lock);
+            return p;
+        }
+        *more = (arena_cur != nullptr);
+        if (arena_cur)
+            arena_tail_keep();
+        char *a = pool_take();
+        if (!a)
+            a = arena_map(false);
+        if (!a) {
+            slab_unlock(&arena_lock);
+            return nullptr;
+        }
+        arena_cur = a;
+        arena_end = arena_cur + SLAB_ARENA_SZ;
+    }
+    p = arena_cur;
+    arena_cur += sz;
+    slab_unlock(&arena_lock);
+    return p;
+}
+
+// Medium chunks past the few idle ones a class keeps give their pages
+// back. They come back zeroed, so the chunk reads as fresh and gets
+// clobbered when handed out again.
+static bool slab_trim(size_t idx, char *p, size_t l) {
+#if defined(__linux__)
+    if (idx < SLAB_NSMALL || huge_mode() == HUGEPAGES_TLB ||
+        __atomic_load_n(&slabs[idx].cnt, __ATOMIC_RELAXED) < SLAB_IDLE_KEEP)
+        return false;
+    size_t pgsz = page_sz();
+    char *u = p + hdrsz;
+    auto s = reinterpret_cast<char *>(
+        (reinterpret_cast<uintptr_t>(u) + pgsz - 1) & ~(pgsz - 1));
+    auto e = reinterpret_cast<char *>(
+        reinterpret_cast<uintptr_t>(p + slab_class_sz(idx)) & ~(pgsz - 1));
+    if (e <= s || madvise(s, e - s, MADV_DONTNEED))
+        return false;
+    // only the bytes around the dropped pages still hold user data
+    safe_memset(p, 0, s - p);
+    if (u + l > e)
+        safe_memset(e, 0, u + l - e);
+    return true;
+#else
+    (void)idx;
+    (void)p;
+    (void)l;
+    return false;
+#endif
+}
+
+#endif
+
+#if defined(HAS_TCACHE)
+#if defined(USE_MMAP)
+static void pool_start(void);
+#endif
+
+static void set_hdr(char *p, uint32_t cls, size_t l) {
+    ::memcpy(p, &canary, cl);
+    ::memcpy(p + cl, &cls, sizeof(cls));
+    ::memcpy(p + hdrsz - szl, &l, szl);
+}
+
+// free chunks link through the length slot, canary and class stay readable
+static void *chunk_next(void *c) {
+    void *n;
+    ::memcpy(&n, reinterpret_cast<char *>(c) + hdrsz - szl, sizeof(n));
+    return n;
+}
+
+static void chunk_link(void *c, void *n) {
+    ::memcpy(reinterpret_cast<char *>(c) + hdrsz - szl, &n, sizeof(n));
+}
+
+#if !defined(USE_MMAP)
+static size_t slab_run_hash(uintptr_t run) {
+    return ((run / SLAB_RUN_SZ) * 0x9e3779b97f4a7c15ull >> 32) % SLAB_RUNS_MAX;
+}
+
+// runs are never handed back to libc, a registered address stays ours
+static bool slab_run_add(char *run, size_t idx) {
+    uintptr_t e = reinterpret_cast<uintptr_t>(run) | idx;
+    if (__atomic_add_fetch(&slab_nruns, 1, __ATOMIC_RELAXED) >
+        SLAB_RUNS_MAX / 4 * 3) {
+        __atomic_sub_fetch(&slab_nruns, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    for (size_t i = slab_run_hash(reinterpret_cast<uintptr_t>(run));;
+         i = (i + 1) % SLAB_RUNS_MAX) {
+        uintptr_t z = 0;
+        if (__atomic_compare_exchange_n(&slab_runs[i], &z, e, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return true;
+    }
+}
+
+// the chunk of a registered run holding ptr, nullptr for a block libc
+// handed out; only the run table is read, never memory around ptr
+static char *slab_chunk(void *ptr, uint32_t *cls) {
+    uintptr_t u = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t run = u & ~(SLAB_RUN_SZ - 1);
+    for (size_t i = slab_run_hash(run);; i = (i + 1) % SLAB_RUNS_MAX) {
+        uintptr_t e = __atomic_load_n(&slab_runs[i], __ATOMIC_ACQUIRE);
+        if (!e)
+            return nullptr;
+        if ((e & ~(SLAB_RUN_SZ - 1)) != run)
+            continue;
+        *cls = static_cast<uint32_t>(e & (SLAB_RUN_SZ - 1));
+        size_t csz = slab_class_sz(*cls);
+        return reinterpret_cast<char *>(run + (u - run) / csz * csz);
+    }
+}
+#endif
+
+// the mmap build refills a class from the arenas, the libc one from
+// posix_memalign; both hand back a chain of up to n chunks in *head
+static size_t slab_get_batch(size_t idx, size_t n, void **head) {
+    struct slab_class *sc = &slabs[idx];
+    size_t got = 0;
+#if defined(USE_MMAP)
+    bool more = false;
+#endif
+
+    *head = nullptr;
+#if !defined(USE_MMAP)
+    init_libc();
+#endif
+    slab_lock(&sc->lock);
+#if defined(USE_MMAP)
+    if (!sc->freelst) {
+        // medium classes carve two chunks up to a sixteenth of an arena
+        // and a single one above
+        size_t csz = slab_class_sz(idx);
+        size_t rsz = csz <= SLAB_ARENA_SZ / 16 ? csz * 2 : csz;
+        if (rsz < SLAB_RUN_SZ)
+            rsz = SLAB_RUN_SZ;
+        char *r = arena_carve(rsz, &more);
+        if (!r) {
+            slab_unlock(&sc->lock);
+            return 0;
+        }
+        // chunks are clobbered when handed out, the run is not touched
+        for (size_t o = rsz - (rsz % csz); o > 0; o -= csz) {
+            char *c = r + o - csz;
+            chunk_link(c, sc->freelst);
+            sc->freelst = c;
+            sc->cnt++;
+        }
+    }
+#else
+    // runs aligned on their size, so the run of a pointer is found by
+    // masking it
+    char *r;
+    if (!sc->freelst && !opmemalign(reinterpret_cast<void **>(&r),
+                                    SLAB_RUN_SZ, SLAB_RUN_SZ)) {
+        if (slab_run_add(r, idx)) {
+            size_t csz = slab_class_sz(idx);
+            for (size_t o = SLAB_RUN_SZ - (SLAB_RUN_SZ % csz); o > 0;
+                 o -= csz) {
+                char *c = r + o - csz;
+                chunk_link(c, sc->freelst);
+                sc->freelst = c;
+                sc->cnt++;
+            }
+        } else {
+            ofree(r);
+        }
+    }
+#endif
+    while (got < n && sc->freelst) {
+        void *c = sc->freelst;
+        sc->freelst = chunk_next(c);
+        sc->cnt--;
+        chunk_link(c, *head);
+        *head = c;
+        got++;
+    }
+    slab_unlock(&sc->lock);
+#if defined(USE_MMAP)
+    // a process that went through a whole arena is likely to need more,
+    // the refill thread only starts then and with no lock held
+    if (more)
+        pool_start();
+#endif
+    return got;
+}
+
+static void slab_put_batch(size_t idx, void *head, void *tail, size_t n) {
+    struct slab_class *sc = &slabs[idx];
+    slab_lock(&sc->lock);
+    chunk_link(tail, sc->freelst);
+    sc->freelst = head;
+    sc->cnt += n;
+    slab_unlock(&sc->lock);
+}
+
+// same order as slab_get_batch: class, arena then pool
+static void slab_prefork(void) {
+    for (size_t i = 0; i < SLAB_NCLASSES; i++)
+        slab_lock(&slabs[i].lock);
+#if defined(USE_MMAP)
+    slab_lock(&arena_lock);
+    pthread_mutex_lock(&pool_mtx);
+#endif
+}
+
+static void slab_postfork(void) {
+#if defined(USE_MMAP)
+    pthread_mutex_unlock(&pool_mtx);
+    slab_unlock(&arena_lock);
+#endif
+    for (size_t i = SLAB_NCLASSES; i > 0; i--)
+        slab_unlock(&slabs[i - 1].lock);
+}
+
+static void slab_postfork_child(void) {
+#if defined(USE_MMAP)
+    pool_fork_child();
+#endif
+    slab_postfork();
+}
+
+static void tcache_flush(size_t idx, size_t n) {
+    struct tcache_bin *bin = &tcache[idx];
+    void *head = bin->head;
+    void *tail = head;
+    size_t cnt = 1;
+
+    if (!head)
+        return;
+    while (cnt < n && chunk_next(tail)) {
+        tail = chunk_next(tail);
+        cnt++;
+    }
+    bin->head = chunk_next(tail);
+    bin->cnt -= cnt;
+    slab_put_batch(idx, head, tail, cnt);
+}
+
+static void tcache_exit(void *) {
+    tcache_state = 1;
+    for (size_t i = 0; i < SLAB_NCLASSES; i++)
+        tcache_flush(i, tcache[i].cnt);
+}
+
+static void tcache_init_key(void) {
+    pthread_key_create(&tcache_key, tcache_exit);
+    pthread_atfork(slab_prefork, slab_postfork, slab_postfork_child);
+}
+
+#if defined(USE_MMAP)
+// pthread_create may allocate, which comes back here, hence no
+// pthread_once
+static void pool_start(void) {
+    if (__atomic_load_n(&pool_started, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&pool_started, 1, __ATOMIC_ACQ_REL))
+        return;
+    const char *e = getenv("SAFE_PREFAULT_MB");
+    size_t mb = e ? strtoul(e, nullptr, 10) : PREFAULT_DEFAULT_MB;
+    size_t n = (mb << 20) / SLAB_ARENA_SZ;
+    pthread_t td;
+    sigset_t all, old;
+
+    if (!n)
+        return;
+    pthread_once(&tcache_once, tcache_init_key);
+    pool_max = n;
+    // the refill thread must not take the process signals
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&td, nullptr, pool_refill, nullptr) == 0)
+        pthread_detach(td);
+    else
+        pool_max = 0;
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+#endif
+
+static bool tcache_ready(void) {
+    if (tcache_state == 2)
+        return true;
+    if (tcache_state != 0)
+        return false;
+    // anything allocated while registering goes to the shared lists
+    tcache_state = 1;
+    pthread_once(&tcache_once, tcache_init_key);
+    pthread_setspecific(tcache_key, tcache);
+    tcache_state = 2;
+    return true;
+}
+
+static void *tcache_get(size_t idx) {
+    struct tcache_bin *bin;
+    void *c;
+
+    if (idx >= SLAB_NSMALL || !tcache_ready())
+        return slab_get_batch(idx, 1, &c) ? c : nullptr;
+    bin = &tcache[idx];
+    if (!bin->head)
+        bin->cnt = slab_get_batch(idx, TCACHE_BATCH, &bin->head);
+    if (!bin->head)
+        return nullptr;
+    c = bin->head;
+    bin->head = chunk_next(c);
+    bin->cnt--;
+    return c;
+}
+
+static void tcache_put(size_t idx, void *c) {
+    struct tcache_bin *bin;
+
+    if (idx >= SLAB_NSMALL || !tcache_ready()) {
+        chunk_link(c, nullptr);
+        slab_put_batch(idx, c, c, 1);
+        return;
+    }
+    bin = &tcache[idx];
+    chunk_link(c, bin->head);
+    bin->head = c;
+    if (++bin->cnt > TCACHE_MAX)
+        tcache_flush(idx, TCACHE_BATCH);
+}
+#endif
+
+// *clean tells whether the block already holds nothing but CLOBBER
+static int alloc_impl(void **ptr, size_t a, size_t l, bool *clean) {
+    *clean = false;
     if (!ptr)
         return -1;
     errno = 0;
 #if defined(USE_MMAP)
-    size_t tl = (1 + alloc_sz(l + 8)) * 4096;
-    const static size_t hsz = 1 << 21;
-    bool ishp = (l >= hsz && !(l % hsz));
-    int mflags = MAP_SHARED | MAP_ANON;
+    if (l > SIZE_MAX / 2 || a > SIZE_MAX / 4) {
+        *ptr = nullptr;
+        errno = ENOMEM;
+        return -1;
+    }
+    if (a <= hdrsz && hdrsz + l <= ARENA_MAX) {
+        size_t idx = slab_class_of(hdrsz + l);
+        auto p = reinterpret_cast<char *>(tcache_get(idx));
+        if (!p) {
+            *ptr = nullptr;
+            return -1;
+        }
+        // freed chunks and pool arenas are clobbered, a chunk fresh from
+        // the kernel or trimmed still reads as zero
+        int32_t st;
+        ::memcpy(&st, p, cl);
+        set_hdr(p, static_cast<uint32_t>(idx), l);
+        *ptr = p + hdrsz;
+        *clean = (st != 0);
+        return 0;
+    }
+    size_t pgsz = page_sz();
+    size_t off = hdrsz;
+    if (a > off && !(a & (a - 1)))
+        off = a;
+    // hugetlb pages can not be trimmed down to the block
+    if (off <= pgsz && off + l <= SLAB_ARENA_SZ &&
+        huge_mode() != HUGEPAGES_TLB) {
+        char *r = pool_take();
+        if (r) {
+            char *end = r + alloc_sz(off + l) * pgsz;
+            if (end < r + SLAB_ARENA_SZ)
+                munmap(end, r + SLAB_ARENA_SZ - end);
+            set_hdr(r + off - hdrsz, SLAB_DIRECT, l);
+            *ptr = r + off;
+            *clean = true;
+            return 0;
+        }
+    }
+    // large alignments and hugepage backed blocks are met by trimming the
+    // over-sized mapping
+    bool ishp = (l >= HUGE_MAP_SZ && huge_mode() != HUGEPAGES_OFF);
+    size_t pad = off > pgsz ? off : 0;
+    if (ishp && pad < HUGE_MAP_SZ)
+        pad = HUGE_MAP_SZ;
+    size_t tl = alloc_sz(off + l + pad) * pgsz;
+    int mflags = MAP_PRIVATE | MAP_ANON;
 #if defined(__FreeBSD__)
     mflags |= MAP_ALIGNED(12);
     if (ishp)
@@ -279,41 +2014,111 @@ int safe_alloc(void **ptr, size_t a, size_t l) {
         return -1;
     }
     auto p = reinterpret_cast<char *>(*ptr);
-    ::memcpy(p, &canary, cl);
-    p += cl;
-    ::memcpy(p, &l, szl);
-    p += szl;
-    *ptr = p;
+    char *base = p;
+    char *end = p + tl;
+    if (pad) {
+        uintptr_t u = reinterpret_cast<uintptr_t>(p);
+        if (ishp)
+            u = (u + HUGE_MAP_SZ - 1) & ~(HUGE_MAP_SZ - 1);
+        u = (u + hdrsz + off - 1) & ~(off - 1);
+        base = reinterpret_cast<char *>((u - hdrsz) & ~(pgsz - 1));
+        end = base + alloc_sz(u + l - reinterpret_cast<uintptr_t>(base)) * pgsz;
+        if (base > p)
+            munmap(p, base - p);
+        if (end < p + tl)
+            munmap(end, p + tl - end);
+        p = reinterpret_cast<char *>(u) - off;
+    }
 #if defined(__linux__)
+    // the advice only sticks to page aligned ranges, so it covers the
+    // whole mapping rather than the user pointer; it goes first as the
+    // header write already faults a small page in
     if (ishp)
-        madvise(*ptr, l, MADV_HUGEPAGE);
+        madvise(base, end - base, MADV_HUGEPAGE);
 #endif
+    p += off - hdrsz;
+    set_hdr(p, SLAB_DIRECT, l);
+    p += hdrsz;
+    *ptr = p;
     return 0;
 #else
     void *p;
-    int r = posix_memalign(&p, a, l);
+#if defined(HAS_TCACHE)
+    // once the run table is full small blocks come from libc as well
+    if (a <= hdrsz && hdrsz + l <= SLAB_MAX) {
+        size_t idx = slab_class_of(hdrsz + l);
+        auto c = reinterpret_cast<char *>(tcache_get(idx));
+        if (c) {
+            set_hdr(c, static_cast<uint32_t>(idx), l);
+            *ptr = c + hdrsz;
+            return 0;
+        }
+    }
+#endif
+    init_libc();
+    int r = opmemalign(&p, a, l);
     *ptr = p;
     return r;
 #endif
 }
 
+int safe_alloc(void **ptr, size_t a, size_t l) {
+    bool clean;
+    return alloc_impl(ptr, a, l, &clean);
+}
+
 void safe_free(void *ptr) {
     errno = 0;
 #if defined(USE_MMAP)
     if (!ptr)
         return;
     size_t l;
+    uint32_t cls;
     int32_t readc;
     auto p = reinterpret_cast<char *>(ptr);
-    p -= szl;
-    ::memcpy(&l, p, szl);
-    p -= cl;
+    p -= hdrsz;
     ::memcpy(&readc, p, cl);
-    if (readc != canary)
+    ::memcpy(&cls, p + cl, sizeof(cls));
+    ::memcpy(&l, p + hdrsz - szl, szl);
+    if (readc != canary || (cls != SLAB_DIRECT && cls >= SLAB_NCLASSES)) {
         errno = EINVAL;
-    safe_memset(p, CLOBBER, szl);
-    munmap(p, ((1 + alloc_sz(szl + 8)) * 4096));
+        return;
+    }
+    safe_memset(p, CLOBBER, hdrsz);
+    if (cls == SLAB_DIRECT) {
+        size_t pgsz = page_sz();
+        uintptr_t base = reinterpret_cast<uintptr_t>(p) & ~(pgsz - 1);
+        size_t tl = alloc_sz(reinterpret_cast<uintptr_t>(ptr) + l - base);
+        munmap(reinterpret_cast<void *>(base), tl * pgsz);
+    } else if (slab_trim(cls, p, l)) {
+        tcache_put(cls, p);
+    } else {
+        // recycled chunks must not leak their previous content, the whole
+        // chunk is clobbered as the next owner may ask for more than l
+        safe_memset(ptr, CLOBBER, slab_class_sz(cls) - hdrsz);
+        ::memcpy(p, &canary_free, cl);
+        ::memcpy(p + cl, &cls, sizeof(cls));
+        tcache_put(cls, p);
+    }
 #else
+#if defined(HAS_TCACHE)
+    if (!ptr)
+        return;
+    uint32_t cls;
+    char *p = slab_chunk(ptr, &cls);
+    if (p) {
+        int32_t readc;
+        ::memcpy(&readc, p, cl);
+        // a second free must not put the chunk in a cache twice
+        if (p + hdrsz != ptr || readc != canary) {
+            errno = EINVAL;
+            return;
+        }
+        ::memcpy(p, &canary_free, cl);
+        tcache_put(cls, p);
+        return;
+    }
+#endif
     init_libc();
     ofree(ptr);
 #endif
@@ -327,25 +2132,6 @@ char *safe_strcat(char *dst, const char *src) {
     return safe_strncat(dst, src, strlen(src) + 1);
 }
 
-char *safe_strncpy(char *dst, const char *src, size_t l) {
-    int d = 0;
-    char *udst = dst;
-    const char *usrc = src;
-
-    if (!l || !dst || !src)
-        return NULL;
-
-    while (l-- > 0) {
-        if (!*usrc || !(*udst++ = *usrc++))
-            break;
-        ++d;
-    }
-
-    dst[d] = 0;
-
-    return dst;
-}
-
 char *safe_strncat(char *dst, const char *src, size_t l) {
     char *udst = dst;
 
@@ -362,23 +2148,16 @@ char *safe_strncat(char *dst, const char *src, size_t l) {
 }
 
 char *safe_strstr(const char *haystack, const char *needle) {
-    const char *h = haystack;
-    const size_t nl = strlen(needle);
-
-    while (*h) {
-        if (safe_bcmp(h, needle, nl) == 0)
-            return const_cast<char *>(h);
-        ++h;
-    }
-
-    return nullptr;
+    return reinterpret_cast<char *>(safe_memmem(haystack, strlen(haystack),
+                                                needle, strlen(needle)));
 }
 
 void *safe_malloc(size_t l) {
     void *ptr;
-    safe_alloc(&ptr, 16, l);
+    bool clean;
+    alloc_impl(&ptr, 16, l, &clean);
 
-    if (ptr)
+    if (ptr && !clean)
         safe_memset(ptr, CLOBBER, l);
 
     return ptr;
@@ -394,18 +2173,115 @@ void *safe_calloc(size_t nm, size_t l) {
     return ptr;
 }
 
-void *safe_realloc(void *o, size_t l) {
+// moves the live prefix of o into a fresh block, the rest is clobbered
+static void *realloc_move(void *o, size_t ol, size_t l) {
     void *ptr;
-    ptr = safe_malloc(l);
+    safe_alloc(&ptr, 16, l);
 
     if (!ptr)
         return nullptr;
 
+    size_t cp = ol < l ? ol : l;
+    ::memcpy(ptr, o, cp);
+    safe_memset(reinterpret_cast<char *>(ptr) + cp, CLOBBER, l - cp);
     safe_free(o);
-    o = nullptr;
     return ptr;
 }
 
+void *safe_realloc(void *o, size_t l) {
+    if (!o)
+        return safe_malloc(l);
+#if defined(USE_MMAP)
+    size_t ol;
+    uint32_t cls;
+    int32_t readc;
+    auto ptr = reinterpret_cast<char *>(o);
+    char *p = ptr - hdrsz;
+    ::memcpy(&readc, p, cl);
+    ::memcpy(&cls, p + cl, sizeof(cls));
+    ::memcpy(&ol, p + hdrsz - szl, szl);
+    if (readc != canary || (cls != SLAB_DIRECT && cls >= SLAB_NCLASSES)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    if (l > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if (cls != SLAB_DIRECT) {
+        // stay in the chunk unless it would waste more than half of it
+        size_t cap = slab_class_sz(cls) - hdrsz;
+        if (l > cap || hdrsz + l <= slab_class_sz(cls) / 2)
+            return realloc_move(o, ol, l);
+        if (l < ol)
+            safe_memset(ptr + l, CLOBBER, ol - l);
+        else
+            safe_memset(ptr + ol, CLOBBER, l - ol);
+        set_hdr(p, cls, l);
+        return o;
+    }
+    if (hdrsz + l <= ARENA_MAX / 2)
+        return realloc_move(o, ol, l);
+
+    size_t pgsz = page_sz();
+    auto base = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(p) &
+                                         ~(pgsz - 1));
+    size_t otl = alloc_sz(ptr + ol - base) * pgsz;
+    size_t ntl = alloc_sz(ptr + l - base) * pgsz;
+    if (ntl < otl) {
+        // only the part left mapped needs scrubbing
+        safe_memset(ptr + l, CLOBBER, base + ntl - (ptr + l));
+        munmap(base + ntl, otl - ntl);
+        set_hdr(p, SLAB_DIRECT, l);
+        return ptr;
+    }
+    if (ntl > otl) {
+#if defined(__linux__)
+        // the kernel moves the page tables, no byte gets copied
+        void *nb = mremap(base, otl, ntl, MREMAP_MAYMOVE);
+        if (nb == MAP_FAILED)
+            return nullptr;
+        ptr = reinterpret_cast<char *>(nb) + (ptr - base);
+        p = ptr - hdrsz;
+#else
+        return realloc_move(o, ol, l);
+#endif
+    }
+    if (l < ol)
+        safe_memset(ptr + l, CLOBBER, ol - l);
+    else
+        safe_memset(ptr + ol, CLOBBER, l - ol);
+    set_hdr(p, SLAB_DIRECT, l);
+    return ptr;
+#else
+#if defined(HAS_TCACHE)
+    uint32_t cls;
+    char *p = slab_chunk(o, &cls);
+    if (p) {
+        size_t ol;
+        int32_t readc;
+        ::memcpy(&readc, p, cl);
+        ::memcpy(&ol, p + hdrsz - szl, szl);
+        if (p + hdrsz != o || readc != canary) {
+            errno = EINVAL;
+            return nullptr;
+        }
+        size_t cap = slab_class_sz(cls) - hdrsz;
+        if (l > cap || hdrsz + l <= slab_class_sz(cls) / 2)
+            return realloc_move(o, ol, l);
+        if (l > ol)
+            safe_memset(p + hdrsz + ol, CLOBBER, l - ol);
+        set_hdr(p, cls, l);
+        return o;
+    }
+    if (hdrsz + l <= SLAB_MAX)
+        return realloc_move(o, malloc_usable_size(o), l);
+#endif
+    init_libc();
+    return orealloc(o, l);
+#endif
+}
+
 long safe_random(void) {
     long ret;
     safe_getrandom(&ret, sizeof(ret));
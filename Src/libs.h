@@ -2,6 +2,7 @@
 #include <dlfcn.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +29,8 @@ struct p_proc_map {
     uintptr_t s;
     uintptr_t e;
     size_t sz;
+    // some of the range is backed by huge pages right now, on Linux only
+    // safe_proc_smaps_visit reads it
     int hgmp;
     int __reserved;
     int64_t f;
@@ -38,12 +41,19 @@ struct p_proc_map {
 const size_t PROC_MAP_MAX = 256;
 extern struct p_proc_map pmap[PROC_MAP_MAX];
 
+// smallest buffer safe_proc_maps_visit accepts from its caller
+const size_t PROC_MAPS_BUF_MIN = 256;
+// called once per mapping, a non zero return stops the walk
+typedef int (*safe_proc_maps_cb)(const struct p_proc_map *, void *);
+
 void safe_bzero(void *, size_t);
 void *safe_memset(void *, int, size_t);
 int safe_bcmp(const void *, const void *, size_t);
 void *safe_memmem(const void *, size_t, const void *, size_t);
 int safe_getrandom(void *, size_t);
 int safe_proc_maps(pid_t);
+int safe_proc_maps_visit(pid_t, safe_proc_maps_cb, void *, char *, size_t);
+int safe_proc_smaps_visit(pid_t, safe_proc_maps_cb, void *, char *, size_t);
 int safe_alloc(void **, size_t, size_t);
 void safe_free(void *);
 char *safe_strcpy(char *, const char *);
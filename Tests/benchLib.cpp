@@ -0,0 +1,312 @@
+#include "libs.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+static const size_t ALLOC_ROUNDS = 1 << 20;
+static const size_t ALLOC_LIVE = 64;
+
+static int64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct allocWorker {
+    pthread_t td;
+    pthread_barrier_t *start;
+    int64_t ns;
+};
+
+static void *allocWork(void *arg) {
+    auto w = reinterpret_cast<allocWorker *>(arg);
+    void *live[ALLOC_LIVE] = {nullptr};
+
+    pthread_barrier_wait(w->start);
+    int64_t s = nowNs();
+    for (size_t i = 0; i < ALLOC_ROUNDS; i++) {
+        size_t slot = i % ALLOC_LIVE;
+        safe_free(live[slot]);
+        live[slot] = safe_malloc(16 + (i * 40) % 1024);
+    }
+    for (size_t i = 0; i < ALLOC_LIVE; i++)
+        safe_free(live[i]);
+    w->ns = nowNs() - s;
+
+    return nullptr;
+}
+
+void benchAllocScaling(long maxThreads) {
+    for (long n = 1; n <= maxThreads; n *= 2) {
+        pthread_barrier_t start;
+        auto ws = new allocWorker[n];
+        int64_t worst = 0;
+
+        pthread_barrier_init(&start, nullptr, n);
+        for (long i = 0; i < n; i++) {
+            ws[i].start = &start;
+            pthread_create(&ws[i].td, nullptr, allocWork, &ws[i]);
+        }
+        for (long i = 0; i < n; i++) {
+            pthread_join(ws[i].td, nullptr);
+            if (ws[i].ns > worst)
+                worst = ws[i].ns;
+        }
+        pthread_barrier_destroy(&start);
+
+        double ops = static_cast<double>(ALLOC_ROUNDS) * n;
+        fprintf(stderr,
+                "safe_malloc/safe_free threads=%ld: %.2f Mops/s "
+                "(%.1f ns/op per thread)\n",
+                n, ops / worst * 1e3,
+                static_cast<double>(worst) / ALLOC_ROUNDS);
+        delete[] ws;
+    }
+}
+
+static void zeroExplicit(void *p, size_t l) {
+#if defined(__NetBSD__)
+    explicit_memset(p, 0, l);
+#else
+    explicit_bzero(p, l);
+#endif
+}
+
+static double zeroRate(void (*zerofn)(void *, size_t), char *buf, size_t sz) {
+    size_t rounds = (static_cast<size_t>(1) << 28) / sz;
+    if (rounds < 4)
+        rounds = 4;
+
+    zerofn(buf, sz);
+    int64_t s = nowNs();
+    for (size_t i = 0; i < rounds; i++)
+        zerofn(buf, sz);
+    int64_t e = nowNs() - s;
+
+    return static_cast<double>(sz) * rounds / e;
+}
+
+// what safe_memset used to be, one volatile store per byte
+__attribute__((noinline)) static void zeroBytes(void *p, size_t l) {
+    auto vp = reinterpret_cast<volatile char *>(p);
+    for (size_t i = 0; i < l; i++)
+        vp[i] = 0;
+}
+
+static double zeroNs(void (*zerofn)(void *, size_t), char *buf, size_t sz) {
+    const size_t rounds = 1 << 20;
+
+    zerofn(buf, sz);
+    int64_t s = nowNs();
+    for (size_t i = 0; i < rounds; i++)
+        zerofn(buf, sz);
+    int64_t e = nowNs() - s;
+
+    return static_cast<double>(e) / rounds;
+}
+
+// short lengths are all dispatch, safe_bzero must stay within twice the
+// byte loop it replaced; returns 1 when it does not
+int benchZero(void) {
+    const size_t maxSz = static_cast<size_t>(64) << 20;
+    const size_t smallSz[] = {8, 15, 31, 63};
+    auto buf = reinterpret_cast<char *>(safe_malloc(maxSz));
+    int ret = 0;
+
+    for (auto sz : smallSz) {
+        double safe = zeroNs(safe_bzero, buf, sz);
+        double bytes = zeroNs(zeroBytes, buf, sz);
+        double ref = zeroNs(zeroExplicit, buf, sz);
+        bool slow = safe > 2 * bytes;
+        fprintf(stderr,
+                "bzero size=%zu: safe_bzero %.1f ns, byte loop %.1f ns, "
+                "explicit_bzero %.1f ns%s\n",
+                sz, safe, bytes, ref, slow ? " SLOWER THAN THE BYTE LOOP" : "");
+        ret |= slow;
+    }
+
+    for (size_t sz = 8; sz <= maxSz; sz *= 2) {
+        double safe = zeroRate(safe_bzero, buf, sz);
+        double ref = zeroRate(zeroExplicit, buf, sz);
+        fprintf(stderr,
+                "bzero size=%zu: safe_bzero %.2f GB/s, explicit_bzero %.2f "
+                "GB/s (x%.2f)\n",
+                sz, safe, ref, safe / ref);
+    }
+
+    safe_free(buf);
+    return ret;
+}
+
+static double searchRate(void *(*searchfn)(const void *, size_t, const void *,
+                                          size_t),
+                         const char *h, size_t hl, const char *n, size_t nl) {
+    const int rounds = 16;
+    int64_t s = nowNs();
+    for (int i = 0; i < rounds; i++) {
+        void *r = searchfn(h, hl, n, nl);
+        __asm__ __volatile__("" : : "r"(r) : "memory");
+    }
+    int64_t e = nowNs() - s;
+
+    return static_cast<double>(hl) * rounds / e * 1e3;
+}
+
+void benchSearch(void) {
+    const size_t hl = 4 << 20;
+    auto h = reinterpret_cast<char *>(safe_malloc(hl));
+    char n[512];
+    const size_t nls[] = {2, 16, 64, 511};
+
+    for (auto nl : nls) {
+        // a...ab, a...aba, (ab)*c over a* or (ab)*, needle absent from text
+        const char *names[] = {"aaaa...b", "aaaa...ba", "periodic ab", "text"};
+
+        for (int c = 0; c < 4; c++) {
+            for (size_t i = 0; i < hl; i++) {
+                if (c < 2)
+                    h[i] = 'a';
+                else if (c == 2)
+                    h[i] = 'a' + (i & 1);
+                else
+                    h[i] = 'a' + (i * 7 + i / 13) % 26;
+            }
+            for (size_t i = 0; i < nl; i++)
+                n[i] = c == 2 ? 'a' + (i & 1) : c < 2 ? 'a' : h[i + 1000];
+            n[nl - 1] = c == 2 ? 'c' : 'b';
+            if (c == 1) {
+                n[nl - 2] = 'b';
+                n[nl - 1] = 'a';
+            }
+
+            double safe = searchRate(safe_memmem, h, hl, n, nl);
+            double ref = searchRate(memmem, h, hl, n, nl);
+            fprintf(stderr,
+                    "memmem %s needle=%zu: safe_memmem %.1f MB/s, memmem "
+                    "%.1f MB/s (x%.2f)\n",
+                    names[c], nl, safe, ref, safe / ref);
+        }
+    }
+
+    safe_free(h);
+}
+
+void benchRand(void) {
+    const size_t rounds = 1 << 22;
+    long acc = 0;
+
+    int64_t s = nowNs();
+    for (size_t i = 0; i < rounds; i++)
+        acc ^= safe_random();
+    int64_t e = nowNs() - s;
+    fprintf(stderr, "safe_random: %.1f ns/call (%lx)\n",
+            static_cast<double>(e) / rounds, acc);
+
+    unsigned char buf[4096];
+    for (size_t sz = 4; sz <= sizeof(buf); sz *= 4) {
+        size_t n = rounds / sz + 1024;
+        s = nowNs();
+        for (size_t i = 0; i < n; i++)
+            safe_getrandom(buf, sz);
+        e = nowNs() - s;
+        fprintf(stderr, "safe_getrandom size=%zu: %.1f ns/call, %.1f MB/s\n",
+                sz, static_cast<double>(e) / n,
+                static_cast<double>(sz) * n / e * 1e3);
+    }
+}
+
+static int cmpNs(const void *a, const void *b) {
+    int64_t x = *reinterpret_cast<const int64_t *>(a);
+    int64_t y = *reinterpret_cast<const int64_t *>(b);
+    return (x > y) - (x < y);
+}
+
+// allocations paced like a service would, so the prefault pool can keep up
+void benchAllocLatency(void) {
+    const size_t sizes[] = {64 << 10, 512 << 10, 2 << 20};
+    const size_t rounds = 256;
+    int64_t lat[rounds];
+
+    for (auto sz : sizes) {
+        for (size_t i = 0; i < rounds; i++) {
+            int64_t s = nowNs();
+            auto p = reinterpret_cast<char *>(safe_malloc(sz));
+            p[sz - 1] = 1;
+            lat[i] = nowNs() - s;
+            safe_free(p);
+            struct timespec gap = {0, 2000000};
+            nanosleep(&gap, nullptr);
+        }
+        qsort(lat, rounds, sizeof(lat[0]), cmpNs);
+        fprintf(stderr, "safe_malloc size=%zu: p50 %.1f us, p99 %.1f us\n", sz,
+                lat[rounds / 2] / 1e3, lat[rounds * 99 / 100] / 1e3);
+    }
+}
+
+static int countMap(const struct p_proc_map *m, void *arg) {
+    *reinterpret_cast<size_t *>(arg) += m->sz;
+    return 0;
+}
+
+void benchProcMaps(void) {
+    const size_t nmaps = 20000, rounds = 20;
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    auto many = reinterpret_cast<char *>(mmap(nullptr, nmaps * pgsz,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANON, -1, 0));
+    for (size_t i = 0; i < nmaps; i += 2)
+        mprotect(many + i * pgsz, pgsz, PROT_READ);
+
+    size_t tot = 0;
+    int64_t s = nowNs();
+    for (size_t i = 0; i < rounds; i++)
+        safe_proc_maps_visit(-1, countMap, &tot, nullptr, 0);
+    int64_t safe = nowNs() - s;
+
+    // what safe_proc_maps used to do, without its 256 entries cap
+    s = nowNs();
+    for (size_t i = 0; i < rounds; i++) {
+        FILE *fp = fopen("/proc/self/maps", "r");
+        char buf[256];
+        while (fp && fgets(buf, sizeof(buf), fp)) {
+            uintptr_t ms, me;
+            char flag[4];
+            sscanf(buf, "%12lx-%12lx %c%c%c%c", &ms, &me, &flag[0], &flag[1],
+                   &flag[2], &flag[3]);
+            tot += me - ms;
+        }
+        if (fp)
+            fclose(fp);
+    }
+    int64_t ref = nowNs() - s;
+
+    // the huge page residency walk, for what it costs on top
+    s = nowNs();
+    for (size_t i = 0; i < rounds; i++)
+        safe_proc_smaps_visit(-1, countMap, &tot, nullptr, 0);
+    int64_t hp = nowNs() - s;
+
+    fprintf(stderr,
+            "proc maps %zu mappings: visit %.2f ms, stdio %.2f ms (x%.2f), "
+            "smaps visit %.2f ms %zu\n",
+            nmaps, safe / 1e6 / rounds, ref / 1e6 / rounds,
+            static_cast<double>(ref) / safe, hp / 1e6 / rounds, tot);
+    munmap(many, nmaps * pgsz);
+}
+
+int main(int argc, char **argv) {
+    long maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1)
+        maxThreads = strtol(argv[1], nullptr, 10);
+    if (maxThreads < 1)
+        maxThreads = 1;
+
+    benchAllocScaling(maxThreads);
+    benchAllocLatency();
+    int ret = benchZero();
+    benchSearch();
+    benchRand();
+    benchProcMaps();
+
+    return ret;
+}
@@ -0,0 +1,142 @@
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+using namespace llvm;
+using namespace std;
+
+static int64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static Function *declare(Module &M, const char *Name, Type *Ret,
+                         vector<Type *> Args) {
+    FunctionType *Ft = FunctionType::get(Ret, Args, false);
+    return Function::Create(Ft, Function::ExternalLinkage, Name, &M);
+}
+
+// clang -O0 shaped calls: arguments loaded from the stack, the result
+// stored right after the call as the pass expects, unrelated calls between
+static void addCaller(Module &M, size_t i, size_t calls) {
+    LLVMContext &C = M.getContext();
+    IRBuilder<> Builder(C);
+    Type *PtrTy = Builder.getInt8PtrTy();
+    FunctionType *Ft = FunctionType::get(Builder.getVoidTy(), false);
+    Function *Fnc = Function::Create(Ft, Function::InternalLinkage,
+                                     "caller" + to_string(i), &M);
+    Builder.SetInsertPoint(BasicBlock::Create(C, "entry", Fnc));
+
+    Value *Slot = Builder.CreateAlloca(PtrTy, nullptr, "slot");
+    Value *Res = Builder.CreateAlloca(Builder.getInt32Ty(), nullptr, "res");
+    Value *Sz = Builder.getInt64(64);
+    Value *P = Builder.CreateCall(M.getFunction("malloc"), {Sz});
+    Builder.CreateStore(P, Slot);
+
+    for (size_t j = 0; j < calls; j++) {
+        P = Builder.CreateLoad(PtrTy, Slot);
+        switch (j % 5) {
+        case 0:
+            Builder.CreateStore(
+                Builder.CreateCall(M.getFunction("memset"),
+                                   {P, Builder.getInt32(0), Sz}),
+                Slot);
+            break;
+        case 1:
+            Builder.CreateStore(
+                Builder.CreateCall(M.getFunction("bcmp"), {P, P, Sz}), Res);
+            break;
+        case 2:
+            Builder.CreateStore(
+                Builder.CreateCall(M.getFunction("strcpy"), {P, P}), Slot);
+            break;
+        case 3:
+            Builder.CreateStore(
+                Builder.CreateCall(M.getFunction("memmem"), {P, Sz, P, Sz}),
+                Slot);
+            break;
+        default:
+            Builder.CreateStore(
+                Builder.CreateCall(M.getFunction("puts"), {P}), Res);
+            break;
+        }
+    }
+
+    P = Builder.CreateLoad(PtrTy, Slot);
+    Builder.CreateCall(M.getFunction("free"), {P});
+    Builder.CreateRetVoid();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        errs() << "usage: " << argv[0] << " plugin [functions] [calls]\n";
+        return 1;
+    }
+    size_t funcs = argc > 2 ? ::strtoul(argv[2], nullptr, 10) : 2000;
+    size_t calls = argc > 3 ? ::strtoul(argv[3], nullptr, 10) : 500;
+
+    string Err;
+    if (sys::DynamicLibrary::LoadLibraryPermanently(argv[1], &Err)) {
+        errs() << Err << "\n";
+        return 1;
+    }
+    const PassInfo *PI =
+        PassRegistry::getPassRegistry()->getPassInfo(StringRef("custom-lib"));
+    if (!PI) {
+        errs() << "custom-lib pass not registered by " << argv[1] << "\n";
+        return 1;
+    }
+
+    LLVMContext C;
+    Module M("synthetic", C);
+    Type *PtrTy = Type::getInt8PtrTy(C);
+    Type *I32Ty = Type::getInt32Ty(C);
+    Type *I64Ty = Type::getInt64Ty(C);
+    declare(M, "malloc", PtrTy, {I64Ty});
+    declare(M, "free", Type::getVoidTy(C), {PtrTy});
+    declare(M, "memset", PtrTy, {PtrTy, I32Ty, I64Ty});
+    declare(M, "bcmp", I32Ty, {PtrTy, PtrTy, I64Ty});
+    declare(M, "strcpy", PtrTy, {PtrTy, PtrTy});
+    declare(M, "memmem", PtrTy, {PtrTy, I64Ty, PtrTy, I64Ty});
+    declare(M, "puts", I32Ty, {PtrTy});
+
+    for (size_t i = 0; i < funcs; i++)
+        addCaller(M, i, calls);
+
+    legacy::PassManager PM;
+    PM.add(PI->createPass());
+    int64_t s = nowNs();
+    PM.run(M);
+    int64_t e = nowNs() - s;
+
+    // only puts is left alone by the pass
+    size_t left = 0;
+    for (auto &F : M) {
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                auto CI = dyn_cast<CallInst>(&I);
+                if (CI && CI->getCalledFunction() &&
+                    CI->getCalledFunction()->getName() != "puts" &&
+                    !CI->getCalledFunction()->getName().startswith("safe_"))
+                    left++;
+            }
+        }
+    }
+
+    outs() << "custom-lib: " << funcs * (calls + 2) << " calls in " << funcs
+           << " functions, " << format("%.1f", e / 1e6) << " ms ("
+           << format("%.1f", static_cast<double>(e) / (funcs * (calls + 2)))
+           << " ns/call), " << left << " not replaced\n";
+
+    return left ? 1 : 0;
+}
@@ -1,5 +1,45 @@
 #include "libs.h"
 #include <assert.h>
+#include <sys/wait.h>
+
+struct mapsCount {
+    size_t n;
+    uintptr_t want;
+    bool found;
+};
+
+static int countMaps(const struct p_proc_map *m, void *arg) {
+    auto c = reinterpret_cast<mapsCount *>(arg);
+    c->n++;
+    c->found |= (m->s == c->want && m->fstr[0] == 'r' && m->fstr[1] == '-');
+    return 0;
+}
+
+#if defined(USE_MMAP)
+struct mapsFind {
+    uintptr_t p;
+    int hgmp;
+};
+
+static int findMap(const struct p_proc_map *m, void *arg) {
+    auto f = reinterpret_cast<mapsFind *>(arg);
+    if (f->p < m->s || f->p >= m->e)
+        return 0;
+    f->hgmp = m->hgmp;
+    return 1;
+}
+
+// THP turned off system wide, nothing can be huge page backed
+static bool thpNever(void) {
+    char buf[128] = {0};
+    int fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+    if (fd == -1)
+        return false;
+    ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    return r > 0 && strstr(buf, "[never]");
+}
+#endif
 
 void testCond(const char *name, bool cond) {
     fprintf(stderr, "%s: ", name);
@@ -15,32 +55,215 @@ int main(int argc, char **argv) {
     int ret = -1;
     char p[12];
     char buf[256];
+    char bbuf[256];
     char *str;
     void *ptr;
     safe_bzero(p, sizeof(p));
     testCond("safe_bzero", p[0] == 0);
     ret = safe_getrandom(buf, sizeof(buf));
     testCond("safe_getrandom", ret == 0);
+    long rnd[2] = {safe_random(), safe_random()};
+    int fds[2];
+    ret = pipe(fds);
+    pid_t child = fork();
+    if (child == 0) {
+        long crnd = safe_random();
+        ssize_t w = write(fds[1], &crnd, sizeof(crnd));
+        _exit(w != sizeof(crnd));
+    }
+    long crnd = 0, prnd = safe_random();
+    ret |= (read(fds[0], &crnd, sizeof(crnd)) != sizeof(crnd));
+    waitpid(child, nullptr, 0);
+    close(fds[0]);
+    close(fds[1]);
+    testCond("safe_random fork",
+             ret == 0 && rnd[0] != rnd[1] && crnd != prnd);
     ret = safe_bcmp("a", "a", 1);
     testCond("safe_bcmp", ret == 0);
     ret = safe_bcmp("a", "b", 1);
     testCond("safe_bcmp", ret != 0);
+    ret = 0;
+    safe_memset(buf, 'x', sizeof(buf));
+    safe_memset(bbuf, 'x', sizeof(bbuf));
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        ret |= safe_bcmp(buf, bbuf, i + 1);
+        bbuf[i] = 'y';
+        ret |= (safe_bcmp(buf, bbuf, sizeof(buf)) != ('x' ^ 'y'));
+        bbuf[i] = 'x';
+    }
+    testCond("safe_bcmp wide", ret == 0);
     ret = safe_proc_maps(-1);
     testCond("safe_proc_maps", ret != -1);
+    // every other page read only splits the mapping in 800 entries
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    auto many = reinterpret_cast<char *>(mmap(nullptr, 800 * pgsz,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANON, -1, 0));
+    for (size_t i = 0; i < 800; i += 2)
+        mprotect(many + i * pgsz, pgsz, PROT_READ);
+    mapsCount big = {0, reinterpret_cast<uintptr_t>(many) + 10 * pgsz, false};
+    mapsCount small = big;
+    mapsCount smaps = big;
+    char mbuf[PROC_MAPS_BUF_MIN];
+    ret = safe_proc_maps_visit(-1, countMaps, &big, nullptr, 0);
+    ret |= safe_proc_maps_visit(-1, countMaps, &small, mbuf, sizeof(mbuf));
+    ret |= safe_proc_smaps_visit(-1, countMaps, &smaps, mbuf, sizeof(mbuf));
+    testCond("safe_proc_maps_visit",
+             ret == 0 && big.n > 800 && small.n > 800 && big.found &&
+                 small.found && smaps.n == small.n && smaps.found);
+    munmap(many, 800 * pgsz);
+#if defined(USE_MMAP)
+    // hgmp tells what backs the pages, so they get touched first
+    void *med = safe_malloc(200000);
+    void *large = safe_malloc(3 << 20);
+    memset(med, 1, 200000);
+    memset(large, 1, 3 << 20);
+    mapsFind fmed = {reinterpret_cast<uintptr_t>(med), -1};
+    mapsFind flarge = {reinterpret_cast<uintptr_t>(large), -1};
+    ret = safe_proc_smaps_visit(-1, findMap, &fmed, nullptr, 0);
+    ret |= safe_proc_smaps_visit(-1, findMap, &flarge, nullptr, 0);
+    if (thpNever())
+        errno = ENOSYS;
+    testCond("safe_alloc hugepages",
+             ret == 0 && fmed.hgmp == 1 && flarge.hgmp == 1);
+    safe_free(med);
+    safe_free(large);
+#endif
     ret = safe_alloc(&ptr, 4096, 16);
     testCond("safe_alloc", ret == 0);
     safe_free(ptr);
     ret = safe_alloc(&ptr, 4096, 1<<21);
     testCond("safe_alloc", ret == 0);
     safe_free(ptr);
+    void *ptrs[512];
+    ret = 0;
+    for (int i = 0; i < 512; i++) {
+        ptrs[i] = safe_malloc(1 + (i * 67) % 40000);
+        ret |= (ptrs[i] == nullptr);
+        ret |= (reinterpret_cast<uintptr_t>(ptrs[i]) % 16);
+    }
+    for (int i = 0; i < 512; i++)
+        safe_free(ptrs[i]);
+    testCond("safe_malloc slabs", ret == 0);
+    ptr = safe_malloc(24);
+    safe_free(ptr);
+    safe_free(ptr);
+    testCond("safe_free double free", errno == EINVAL);
+    // cached once only, two allocations can not be handed the same chunk
+    str = reinterpret_cast<char *>(safe_malloc(24));
+    ptr = safe_malloc(24);
+    testCond("safe_free double free reuse", str != ptr);
+    safe_free(str);
+    safe_free(ptr);
+#if !defined(USE_MMAP)
+    // a libc block goes back to libc even when the neighbour in front of
+    // it ends with bytes looking like a chunk header
+    str = reinterpret_cast<char *>(malloc(24));
+    ptr = malloc(24);
+    char *lo = str < ptr ? str : reinterpret_cast<char *>(ptr);
+    char *hi = str < ptr ? reinterpret_cast<char *>(ptr) : str;
+    // glibc puts two 24 bytes blocks 32 bytes apart, the tail of the first
+    // one overlapping the 16 bytes in front of the second
+    bool adj = (hi == lo + 32);
+    const uint32_t fake[2] = {0x3aff5d, 0};
+    if (adj)
+        memcpy(hi - 16, fake, sizeof(fake));
+    safe_free(hi);
+    testCond("safe_free libc neighbour",
+             !adj || !memcmp(hi - 16, fake, sizeof(fake)));
+    free(lo);
+#endif
+    errno = 0;
+    ret = safe_alloc(&ptr, 1 << 16, 100);
+    testCond("safe_alloc aligned",
+             ret == 0 && !(reinterpret_cast<uintptr_t>(ptr) % (1 << 16)));
+    safe_free(ptr);
     ret = (safe_memmem("ab", 2, "cd", 2) == nullptr);
     testCond("safe_memmem", ret == 1);
     ret = (safe_memmem("abcd", 4, "cd", 2) != nullptr);
     testCond("safe_memmem", ret == 1);
+    ret = 0;
+    for (int i = 0; i < 2000; i++) {
+        char h[300];
+        char n[40];
+        size_t hl = 1 + (i * 37) % sizeof(h);
+        size_t nl = 1 + (i * 13) % sizeof(n);
+        for (size_t j = 0; j < hl; j++)
+            h[j] = 'a' + (j * (i % 7 + 1) / 5 + i) % (i % 3 + 2);
+        for (size_t j = 0; j < nl; j++)
+            n[j] = 'a' + (j * (i % 5 + 1) / 3 + i) % (i % 3 + 2);
+        char *ref = nullptr;
+        for (size_t j = 0; j + nl <= hl && !ref; j++) {
+            if (!memcmp(h + j, n, nl))
+                ref = h + j;
+        }
+        ret |= (safe_memmem(h, hl, n, nl) != ref);
+    }
+    testCond("safe_memmem periodic", ret == 0);
+    // random needles over 1 to 4 letters against a naive search, a failing
+    // seed is printed to replay it
+    uint64_t seed = static_cast<uint64_t>(safe_random()) | 1;
+    uint64_t x = seed;
+    auto next = [&x]() {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return x;
+    };
+    ret = 0;
+    for (int i = 0; i < 200000 && !ret; i++) {
+        char h[301];
+        char n[41];
+        size_t alpha = 1 + next() % 4;
+        size_t hl = next() % 4 ? next() % 40 : next() % (sizeof(h) - 1);
+        size_t nl = 1 + (next() % 3 ? next() % 12 : next() % (sizeof(n) - 1));
+        for (size_t j = 0; j < hl; j++)
+            h[j] = 'a' + next() % alpha;
+        for (size_t j = 0; j < nl; j++)
+            n[j] = 'a' + next() % alpha;
+        // plant the needle, sometimes with one byte off
+        if (next() % 2 && hl >= nl) {
+            size_t o = next() % (hl - nl + 1);
+            memcpy(h + o, n, nl);
+            if (next() % 2)
+                h[o + next() % nl] ^= 1;
+        }
+        h[hl] = 0;
+        n[nl] = 0;
+        char *ref = nullptr;
+        for (size_t j = 0; j + nl <= hl && !ref; j++) {
+            if (!memcmp(h + j, n, nl))
+                ref = h + j;
+        }
+        ret |= (safe_memmem(h, hl, n, nl) != ref);
+        ret |= (safe_strstr(h, n) != ref);
+    }
+    if (ret)
+        fprintf(stderr, "seed %" PRIu64 "\n", seed);
+    testCond("safe_memmem random", ret == 0);
     safe_memset(buf, '1', sizeof(buf) - 1);
     testCond("safe_memset", buf[0] == '1');
     safe_strncpy(p, "abcdefeghijklmnopq", 10);
     testCond("safe_strncpy", !strcmp(p, "abcdefeghi"));
+    // sources ending right before an unmapped page, bounds on both sides
+    auto pg = reinterpret_cast<char *>(mmap(nullptr, 2 * pgsz,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANON, -1, 0));
+    mprotect(pg + pgsz, pgsz, PROT_NONE);
+    ret = 0;
+    for (size_t sl = 0; sl < 200; sl++) {
+        char *src = pg + pgsz - sl - 1;
+        memset(src, 'a' + sl % 26, sl);
+        src[sl] = 0;
+        for (size_t l = 1; l < sl + 70; l += 7) {
+            size_t n = sl < l ? sl : l;
+            memset(bbuf, 'z', sizeof(bbuf));
+            ret |= (safe_strncpy(bbuf, src, l) != bbuf);
+            ret |= (memcmp(bbuf, src, n) != 0 || bbuf[n] != 0);
+        }
+    }
+    munmap(pg, 2 * pgsz);
+    testCond("safe_strncpy wide", ret == 0);
     safe_strncat(p, "def", 10);
     testCond("safe_strncat", !strcmp(p, "abcdefeghi"));
     safe_strcpy(p, "g");
@@ -63,5 +286,56 @@ int main(int argc, char **argv) {
     ptr = safe_calloc(16, 32);
     safe_free(ptr);
 
+    // recycled chunks and pooled regions come back fully clobbered
+    ret = 0;
+    for (int i = 0; i < 300; i++) {
+        size_t sz = 1 + (i * 7919) % (i % 3 ? 40000 : 3000000);
+        auto c = reinterpret_cast<unsigned char *>(safe_malloc(sz));
+        for (size_t j = 0; c && j < sz; j++)
+            ret |= (c[j] != 0xad);
+        if (c)
+            memset(c, i, sz);
+        safe_free(c);
+    }
+    testCond("safe_malloc clobber", ret == 0);
+
+    // medium chunks past the idle ones give their pages back, yet come
+    // back clobbered like the others
+    void *meds[8];
+    ret = 0;
+    for (auto &m : meds) {
+        m = safe_malloc(300000);
+        memset(m, 'x', 300000);
+    }
+    for (auto m : meds)
+        safe_free(m);
+    for (auto &m : meds) {
+        auto c = reinterpret_cast<unsigned char *>(safe_malloc(300000));
+        for (size_t j = 0; c && j < 300000; j++)
+            ret |= (c[j] != 0xad);
+        m = c;
+    }
+    for (auto m : meds)
+        safe_free(m);
+    testCond("safe_free medium trim", ret == 0);
+
+    const size_t rsizes[] = {1,    40,     100,     24,     3000,   70000,
+                             5000, 300000, 1 << 22, 200000, 100000, 17};
+    size_t rl = 0;
+    ret = 0;
+    ptr = nullptr;
+    for (auto sz : rsizes) {
+        auto np = reinterpret_cast<unsigned char *>(safe_realloc(ptr, sz));
+        ret |= (np == nullptr);
+        for (size_t i = 0; np && i < (rl < sz ? rl : sz); i++)
+            ret |= (np[i] != static_cast<unsigned char>(i * 31));
+        for (size_t i = 0; np && i < sz; i++)
+            np[i] = static_cast<unsigned char>(i * 31);
+        ptr = np;
+        rl = sz;
+    }
+    safe_free(ptr);
+    testCond("safe_realloc", ret == 0);
+
     return 0;
 }